@@ -1,14 +1,39 @@
 // Copyright (C) 2025 Signal Slot Inc.
 // SPDX-License-Identifier: BSD-3-Clause
 
+#include <QtCore/QCache>
 #include <QtCore/QCommandLineParser>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDateTime>
 #include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
 #include <QtCore/QJsonArray>
 #include <QtCore/QJsonDocument>
 #include <QtCore/QJsonObject>
+#include <QtCore/QMutex>
+#include <QtCore/QRegularExpression>
+#include <QtCore/QSaveFile>
+#include <QtCore/QSharedMemory>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
+#include <QtCore/QTimer>
+#include <QtCore/QVarLengthArray>
+#include <QtCore/QWaitCondition>
+#include <QtCore/QtMath>
+#include <QtConcurrent/QtConcurrentMap>
+#include <QtConcurrent/QtConcurrentRun>
+#include <QtGui/QColorSpace>
+#include <QtGui/QFontMetrics>
+#include <QtGui/QGlyphRun>
 #include <QtGui/QGuiApplication>
 #include <QtGui/QPainter>
+#include <QtGui/QPainterPath>
+#include <QtGui/QTextLayout>
 #include <QtPsdCore/qpsdblend.h>
+#include <QtPsdCore/qpsdouterglowefect.h>
+#include <QtPsdCore/qpsdshadoweffect.h>
 #include <QtMcpCommon/QMcpPrompt>
 #include <QtMcpCommon/QMcpPromptArgument>
 #include <QtMcpCommon/QMcpPromptMessage>
@@ -28,13 +53,611 @@
 #include <QtPsdExporter/QPsdExporterPlugin>
 #include <QtPsdExporter/QPsdExporterTreeItemModel>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#if defined(Q_OS_UNIX)
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
 using namespace Qt::StringLiterals;
 
+// Allocation profiling, built with -DMCP_PSD2X_ALLOC_PROFILING=ON. Every
+// allocation is counted in total and for the internal phase the allocating
+// thread is in, as set by AllocScope.
+enum class AllocPhase { Other, TreeWalk, Serialization, Masking, Compositing, ImageConversion, Count };
+
+static constexpr const char *allocPhaseNames[] = {
+    "other", "treeWalk", "serialization", "masking", "compositing", "imageConversion",
+};
+
+struct AllocSnapshot
+{
+    quint64 count = 0;
+    quint64 bytes = 0;
+    static AllocSnapshot now();
+    static AllocSnapshot forPhase(AllocPhase phase);
+};
+
+#ifdef MCP_PSD2X_ALLOC_PROFILING
+struct AllocCounters
+{
+    std::atomic<quint64> count = 0;
+    std::atomic<quint64> bytes = 0;
+};
+static AllocCounters allocTotal;
+static AllocCounters allocPerPhase[int(AllocPhase::Count)];
+static thread_local int allocPhase = 0;
+
+static inline void countAllocation(size_t size)
+{
+    allocTotal.count.fetch_add(1, std::memory_order_relaxed);
+    allocTotal.bytes.fetch_add(size, std::memory_order_relaxed);
+    allocPerPhase[allocPhase].count.fetch_add(1, std::memory_order_relaxed);
+    allocPerPhase[allocPhase].bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+#if defined(__GLIBC__)
+// Interpose the C allocator so Qt's container and image buffers are seen too
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) noexcept
+{
+    countAllocation(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) noexcept
+{
+    countAllocation(count * size);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) noexcept
+{
+    countAllocation(size);
+    return __libc_realloc(ptr, size);
+}
+}
+#else
+// Elsewhere only C++ allocations are counted
+void *operator new(std::size_t size)
+{
+    countAllocation(size);
+    if (void *ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+#endif
+
+AllocSnapshot AllocSnapshot::now()
+{
+    return {allocTotal.count.load(std::memory_order_relaxed), allocTotal.bytes.load(std::memory_order_relaxed)};
+}
+
+AllocSnapshot AllocSnapshot::forPhase(AllocPhase phase)
+{
+    const auto &counters = allocPerPhase[int(phase)];
+    return {counters.count.load(std::memory_order_relaxed), counters.bytes.load(std::memory_order_relaxed)};
+}
+
+class AllocScope
+{
+public:
+    explicit AllocScope(AllocPhase phase) : previous(std::exchange(allocPhase, int(phase))) {}
+    ~AllocScope() { allocPhase = previous; }
+    Q_DISABLE_COPY_MOVE(AllocScope)
+
+private:
+    int previous;
+};
+#else
+AllocSnapshot AllocSnapshot::now() { return {}; }
+AllocSnapshot AllocSnapshot::forPhase(AllocPhase) { return {}; }
+
+class AllocScope
+{
+public:
+    explicit AllocScope(AllocPhase) {}
+};
+#endif
+
 static QString toJson(const QJsonObject &obj)
 {
+    const AllocScope scope(AllocPhase::Serialization);
     return QString::fromUtf8(QJsonDocument(obj).toJson(QJsonDocument::Compact));
 }
 
+// Append `str` as a quoted, escaped JSON string in UTF-8
+static void appendJsonString(QByteArray &out, QStringView str)
+{
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    const QByteArray utf8 = str.toUtf8();
+    for (const char c : utf8) {
+        switch (c) {
+        case '"':  out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\b': out += "\\b"; break;
+        case '\f': out += "\\f"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (uchar(c) < 0x20) {
+                out += "\\u00";
+                out += hex[uchar(c) >> 4];
+                out += hex[uchar(c) & 0xf];
+            } else {
+                out += c;
+            }
+            break;
+        }
+    }
+    out += '"';
+}
+
+// Document-level intern table for heavily repeated strings (layer names,
+// font names, hint ids). Equal strings share one instance, so indexes can
+// key them by pointer, and each keeps its JSON-encoded UTF-8 form so that
+// serialization does not encode it again.
+class StringPool
+{
+public:
+    QString intern(const QString &str)
+    {
+        const auto it = strings.constFind(str);
+        if (it != strings.cend())
+            return *it;
+        strings.insert(str);
+        const QString interned = *strings.constFind(str);
+        QByteArray json;
+        appendJsonString(json, interned);
+        literals.insert(key(interned), json);
+        return interned;
+    }
+
+    // Identity of an interned string; equal interned strings have equal keys
+    static const void *key(const QString &interned) { return interned.constData(); }
+
+    // JSON literal of an interned string, looked up by pointer
+    QByteArray json(const QString &interned) const
+    {
+        const auto it = literals.constFind(key(interned));
+        if (it != literals.cend())
+            return *it;
+        QByteArray json;
+        appendJsonString(json, interned);
+        return json;
+    }
+
+    void clear()
+    {
+        strings.clear();
+        literals.clear();
+    }
+    qsizetype size() const { return strings.size(); }
+
+    // Approximate heap use of the strings and their JSON literals
+    qint64 bytes() const
+    {
+        qint64 total = 0;
+        for (const auto &str : strings)
+            total += str.size() * sizeof(QChar);
+        for (const auto &json : literals)
+            total += json.size();
+        return total;
+    }
+
+private:
+    QSet<QString> strings;
+    QHash<const void *, QByteArray> literals;
+};
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 8, 0)
+// CMYK to RGB conversion through a precomputed grid. CMY is interpolated
+// tetrahedrally within a K slice and the two nearest K slices linearly.
+// The grid is sampled once per source profile with Qt's exact conversion.
+class CmykLut
+{
+public:
+    static constexpr int Nodes = 17;
+
+    explicit CmykLut(const QColorSpace &colorSpace)
+    {
+        QImage grid(Nodes, Nodes * Nodes * Nodes, QImage::Format_CMYK8888);
+        for (int row = 0; row < grid.height(); ++row) {
+            uchar *line = grid.scanLine(row);
+            const int m = row % Nodes;
+            const int y = (row / Nodes) % Nodes;
+            const int k = row / (Nodes * Nodes);
+            for (int c = 0; c < Nodes; ++c) {
+                line[c * 4 + 0] = nodeValue(c);
+                line[c * 4 + 1] = nodeValue(m);
+                line[c * 4 + 2] = nodeValue(y);
+                line[c * 4 + 3] = nodeValue(k);
+            }
+        }
+
+        QImage rgb;
+        if (colorSpace.isValid()) {
+            grid.setColorSpace(colorSpace);
+            rgb = grid.convertedToColorSpace(QColorSpace::SRgb, QImage::Format_RGB32);
+        } else {
+            rgb = grid.convertToFormat(QImage::Format_RGB32);
+        }
+
+        table.resize(Nodes * Nodes * Nodes * Nodes);
+        for (int row = 0; row < rgb.height(); ++row) {
+            const QRgb *line = reinterpret_cast<const QRgb *>(rgb.constScanLine(row));
+            std::copy(line, line + Nodes, table.begin() + row * Nodes);
+        }
+    }
+
+    // One LUT per source profile, shared by all layers and documents
+    static std::shared_ptr<const CmykLut> forColorSpace(const QColorSpace &colorSpace)
+    {
+        static QMutex mutex;
+        static QHash<QByteArray, std::shared_ptr<const CmykLut>> luts;
+
+        const QByteArray key = colorSpace.isValid()
+            ? QCryptographicHash::hash(colorSpace.iccProfile(), QCryptographicHash::Sha1)
+                + colorSpace.description().toUtf8()
+            : QByteArray();
+        QMutexLocker locker(&mutex);
+        auto &lut = luts[key];
+        if (!lut)
+            lut = std::make_shared<const CmykLut>(colorSpace);
+        return lut;
+    }
+
+    QImage convert(const QImage &cmyk) const
+    {
+        QImage result(cmyk.size(), QImage::Format_RGB32);
+        for (int row = 0; row < cmyk.height(); ++row) {
+            const uchar *src = cmyk.constScanLine(row);
+            QRgb *dst = reinterpret_cast<QRgb *>(result.scanLine(row));
+            for (int x = 0; x < cmyk.width(); ++x, src += 4)
+                dst[x] = map(src[0], src[1], src[2], src[3]);
+        }
+        return result;
+    }
+
+private:
+    QList<QRgb> table;
+
+    static uchar nodeValue(int node)
+    {
+        return uchar((node * 255 + (Nodes - 1) / 2) / (Nodes - 1));
+    }
+
+    // Split an 8-bit channel into a grid cell index and a 0..256 fraction
+    static void split(int value, int &index, int &fraction)
+    {
+        const int pos = value * ((Nodes - 1) * 256) / 255;
+        index = qMin(pos >> 8, Nodes - 2);
+        fraction = pos - (index << 8);
+    }
+
+    QRgb map(int c, int m, int y, int k) const
+    {
+        int ci, fc, mi, fm, yi, fy, ki, fk;
+        split(c, ci, fc);
+        split(m, mi, fm);
+        split(y, yi, fy);
+        split(k, ki, fk);
+
+        int lo[3];
+        int hi[3];
+        sampleSlice(ki, ci, mi, yi, fc, fm, fy, lo);
+        sampleSlice(ki + 1, ci, mi, yi, fc, fm, fy, hi);
+        const auto mix = [&](int ch) {
+            return qBound(0, (lo[ch] * (256 - fk) + hi[ch] * fk + (1 << 15)) >> 16, 255);
+        };
+        return qRgb(mix(0), mix(1), mix(2));
+    }
+
+    // Tetrahedral interpolation within one K slice; results are scaled by 256
+    void sampleSlice(int k, int c, int m, int y, int fc, int fm, int fy, int *out) const
+    {
+        const auto at = [&](int dc, int dm, int dy) {
+            return table.at(((k * Nodes + y + dy) * Nodes + m + dm) * Nodes + c + dc);
+        };
+
+        // Walk from the origin to the far corner along the axes ordered by
+        // decreasing fraction; that path bounds the enclosing tetrahedron
+        const QRgb v0 = at(0, 0, 0);
+        const QRgb v3 = at(1, 1, 1);
+        QRgb v1, v2;
+        int f1, f2, f3;
+        if (fc >= fm) {
+            if (fm >= fy) {
+                v1 = at(1, 0, 0); v2 = at(1, 1, 0); f1 = fc; f2 = fm; f3 = fy;
+            } else if (fc >= fy) {
+                v1 = at(1, 0, 0); v2 = at(1, 0, 1); f1 = fc; f2 = fy; f3 = fm;
+            } else {
+                v1 = at(0, 0, 1); v2 = at(1, 0, 1); f1 = fy; f2 = fc; f3 = fm;
+            }
+        } else {
+            if (fy >= fm) {
+                v1 = at(0, 0, 1); v2 = at(0, 1, 1); f1 = fy; f2 = fm; f3 = fc;
+            } else if (fy >= fc) {
+                v1 = at(0, 1, 0); v2 = at(0, 1, 1); f1 = fm; f2 = fy; f3 = fc;
+            } else {
+                v1 = at(0, 1, 0); v2 = at(1, 1, 0); f1 = fm; f2 = fc; f3 = fy;
+            }
+        }
+
+        for (int ch = 0; ch < 3; ++ch) {
+            const int shift = 16 - ch * 8;
+            const int a0 = (v0 >> shift) & 0xff;
+            const int a1 = (v1 >> shift) & 0xff;
+            const int a2 = (v2 >> shift) & 0xff;
+            const int a3 = (v3 >> shift) & 0xff;
+            out[ch] = (a0 << 8) + f1 * (a1 - a0) + f2 * (a2 - a1) + f3 * (a3 - a2);
+        }
+    }
+};
+#endif
+
+// How previews are rendered
+struct RenderOptions
+{
+    qreal scale = 1.0;
+    // Re-lay-out text layers with the fonts resolved by QPsdFontMapper
+    // instead of drawing the raster baked into the PSD
+    bool mappedText = false;
+
+    static RenderOptions fromJson(const QJsonObject &opts)
+    {
+        RenderOptions options;
+        options.scale = opts["scale"_L1].toDouble(1.0);
+        if (options.scale <= 0)
+            options.scale = 1.0;
+        options.scale = qMin(options.scale, 8.0);
+        options.mappedText = opts["text"_L1].toString() == "mapped"_L1;
+        return options;
+    }
+};
+
+struct RasterCacheKey
+{
+    qint32 layerId;
+    quint64 generation;
+    int scale;
+    bool mappedText = false;
+
+    RasterCacheKey(qint32 layerId, quint64 generation, const RenderOptions &options)
+        : layerId(layerId), generation(generation)
+        , scale(qRound(options.scale * 1000)), mappedText(options.mappedText)
+    {}
+
+    friend bool operator==(const RasterCacheKey &a, const RasterCacheKey &b) noexcept
+    {
+        return a.layerId == b.layerId && a.generation == b.generation
+            && a.scale == b.scale && a.mappedText == b.mappedText;
+    }
+    friend size_t qHash(const RasterCacheKey &key, size_t seed = 0) noexcept
+    {
+        return qHashMulti(seed, key.layerId, key.generation, key.scale, key.mappedText);
+    }
+};
+
+// Read-side copy of a layer's export hint. The known property names are a
+// bit field and the strings are interned, so reading a hint during tree
+// serialization or compositing copies nothing.
+struct CompactHint
+{
+    using ExportHint = QPsdExporterTreeItemModel::ExportHint;
+
+    // Bit i stands for propertyNames[i]
+    static constexpr QStringView propertyNames[] = { u"visible", u"color", u"position", u"text", u"size", u"image" };
+
+    ExportHint::Type type = ExportHint::Embed;
+    decltype(ExportHint::baseElement) baseElement = {};
+    quint8 properties = 0;
+    bool visible = true;
+    QString id;
+    QString componentName;
+    QStringList otherProperties; // names outside propertyNames, normally empty
+
+    static CompactHint fromHint(const ExportHint &hint, StringPool &strings)
+    {
+        CompactHint compact;
+        compact.type = hint.type;
+        compact.baseElement = hint.baseElement;
+        compact.visible = hint.visible;
+        compact.id = strings.intern(hint.id);
+        compact.componentName = strings.intern(hint.componentName);
+        for (const auto &prop : hint.properties) {
+            const auto *it = std::find_if(std::begin(propertyNames), std::end(propertyNames),
+                                          [&prop](QStringView name) { return prop == name; });
+            if (it != std::end(propertyNames))
+                compact.properties |= 1 << (it - std::begin(propertyNames));
+            else
+                compact.otherProperties.append(strings.intern(prop));
+        }
+        return compact;
+    }
+
+    bool hasProperties() const { return properties || !otherProperties.isEmpty(); }
+
+    // Known properties in bit order, then the others
+    template <typename F>
+    void forEachProperty(F f) const
+    {
+        for (size_t i = 0; i < std::size(propertyNames); ++i) {
+            if (properties & (1 << i))
+                f(propertyNames[i]);
+        }
+        for (const auto &prop : otherProperties)
+            f(QStringView(prop));
+    }
+
+    bool isConfigured() const
+    {
+        return type != ExportHint::Embed || !id.isEmpty() || !componentName.isEmpty();
+    }
+};
+
+#if defined(Q_OS_UNIX)
+// Takes stdout writes off the event loop for the stdio backend. fd 1 becomes
+// a pipe; a reader thread drains it into a bounded queue and a writer thread
+// sends the queue to the real stdout in chunks. The event loop only blocks
+// on a response when the queue is full.
+class StdoutRelay
+{
+public:
+    static constexpr qsizetype ChunkSize = 64 * 1024;
+    static constexpr qsizetype MaxQueued = 64 * 1024 * 1024;
+
+    ~StdoutRelay() { finish(); }
+
+    bool start()
+    {
+        int fds[2];
+        if (::pipe(fds) != 0)
+            return false;
+        output = ::dup(STDOUT_FILENO);
+        if (output < 0) {
+            ::close(fds[0]);
+            ::close(fds[1]);
+            return false;
+        }
+#if defined(Q_OS_LINUX)
+        // A larger pipe lets a burst of output land before the reader wakes up
+        ::fcntl(fds[1], F_SETPIPE_SZ, 1024 * 1024);
+#endif
+        std::fflush(stdout);
+        ::dup2(fds[1], STDOUT_FILENO);
+        ::close(fds[1]);
+        input = fds[0];
+        // A vanished client must fail the write, not kill the process
+        std::signal(SIGPIPE, SIG_IGN);
+
+        reader.reset(QThread::create([this] { readLoop(); }));
+        writer.reset(QThread::create([this] { writeLoop(); }));
+        reader->start();
+        writer->start();
+        return true;
+    }
+
+    // Put the real stdout back and wait until everything written reached it
+    void finish()
+    {
+        if (!reader)
+            return;
+        std::fflush(stdout);
+        ::dup2(output, STDOUT_FILENO); // closes the pipe's last write end
+        reader->wait();
+        writer->wait();
+        reader.reset();
+        writer.reset();
+        ::close(input);
+        ::close(output);
+    }
+
+private:
+    void readLoop()
+    {
+        QByteArray buffer(ChunkSize, Qt::Uninitialized);
+        for (;;) {
+            const auto n = ::read(input, buffer.data(), ChunkSize);
+            if (n < 0 && errno == EINTR)
+                continue;
+            QMutexLocker locker(&mutex);
+            if (n <= 0) {
+                closed = true;
+                ready.wakeAll();
+                return;
+            }
+            while (queuedBytes >= MaxQueued && !broken)
+                space.wait(&mutex);
+            if (broken)
+                continue; // keep draining the pipe so writers never block
+            queue.append(QByteArray(buffer.constData(), n));
+            queuedBytes += n;
+            ready.wakeAll();
+        }
+    }
+
+    void writeLoop()
+    {
+        for (;;) {
+            QByteArray chunk;
+            {
+                QMutexLocker locker(&mutex);
+                while (queue.isEmpty() && !closed)
+                    ready.wait(&mutex);
+                if (queue.isEmpty())
+                    return;
+                chunk = queue.takeFirst();
+                queuedBytes -= chunk.size();
+                space.wakeAll();
+            }
+            for (qsizetype done = 0; done < chunk.size();) {
+                const auto n = ::write(output, chunk.constData() + done, chunk.size() - done);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    // The parent may have left stdout non-blocking
+                    pollfd pfd{output, POLLOUT, 0};
+                    ::poll(&pfd, 1, -1);
+                    continue;
+                }
+                if (n <= 0) {
+                    // The client is gone; drop whatever is left
+                    QMutexLocker locker(&mutex);
+                    broken = true;
+                    queue.clear();
+                    queuedBytes = 0;
+                    space.wakeAll();
+                    return;
+                }
+                done += n;
+            }
+        }
+    }
+
+    int input = -1;
+    int output = -1;
+    std::unique_ptr<QThread> reader;
+    std::unique_ptr<QThread> writer;
+    QMutex mutex;
+    QWaitCondition ready;
+    QWaitCondition space;
+    QList<QByteArray> queue;
+    qsizetype queuedBytes = 0;
+    bool closed = false;
+    bool broken = false;
+};
+#endif
+
 class McpServer : public QMcpServer
 {
     Q_OBJECT
@@ -44,6 +667,17 @@ public:
     {
         exporterModel.setSourceModel(&guiModel);
 
+        sessionTimer.setSingleShot(true);
+        sessionTimer.setInterval(1000);
+        connect(&sessionTimer, &QTimer::timeout, this, &McpServer::writeSession);
+
+        batchPool.setMaxThreadCount(1);
+        batchPool.setThreadPriority(QThread::LowPriority);
+
+        uptime.start();
+        idleTimer.setSingleShot(true);
+        connect(&idleTimer, &QTimer::timeout, this, &McpServer::idleTimeout);
+
         connect(this, &QMcpServer::newSession, this, [](QMcpServerSession *session) {
             QMcpPrompt prompt;
             prompt.setName("export-screen"_L1);
@@ -185,44 +819,324 @@ Build or preview to confirm the layout and interactions work correctly.
         });
     }
 
-    Q_INVOKABLE QString load_psd(const QString &path)
+    // Background exports finish before any member goes away
+    ~McpServer() override
     {
-        exporterModel.load(path);
-        const auto err = exporterModel.errorMessage();
-        if (!err.isEmpty())
-            return toJson(QJsonObject{{"error"_L1, err}});
+        batchPool.waitForDone();
+        renderPool.waitForDone();
+    }
 
-        const auto sz = exporterModel.size();
+    // The session file keeps the loaded document and its unsaved hint state
+    // so a restarted server can pick up where the previous one stopped.
+    void setSessionFile(const QString &fileName)
+    {
+        sessionFile = fileName;
+    }
+
+    // Pick up the document recorded in the session file. It is loaded by
+    // the first tool call, so the server starts answering right away; if the
+    // PSD changed on disk since, tools report that instead.
+    void restoreSession()
+    {
+        QFile file(sessionFile);
+        if (sessionFile.isEmpty() || !file.open(QIODevice::ReadOnly))
+            return;
+        pendingState = QJsonDocument::fromJson(file.readAll()).object();
+    }
+
+    // Write the session file now, e.g. before the application quits
+    void writeSession()
+    {
+        sessionTimer.stop();
+        if (sessionFile.isEmpty())
+            return;
+        const auto session = pendingState.isEmpty() ? sessionState() : pendingState;
+        if (session.isEmpty()) {
+            QFile::remove(sessionFile);
+            return;
+        }
+
+        QDir().mkpath(QFileInfo(sessionFile).absolutePath());
+        QSaveFile file(sessionFile);
+        if (!file.open(QIODevice::WriteOnly)) {
+            qWarning("Cannot write session file %s: %s", qPrintable(sessionFile), qPrintable(file.errorString()));
+            return;
+        }
+        file.write(QJsonDocument(session).toJson(QJsonDocument::Compact));
+        if (!file.commit())
+            qWarning("Cannot write session file %s: %s", qPrintable(sessionFile), qPrintable(file.errorString()));
+    }
+
+    // Idle timeouts in seconds; 0 disables a stage. After `releaseAfter`
+    // without a tool call the caches are dropped, after `evictAfter` the
+    // document too. The next tool call reloads an evicted document.
+    void setIdleTimeouts(int releaseAfter, int evictAfter)
+    {
+        idleRelease = releaseAfter;
+        idleEvict = evictAfter;
+        scheduleIdle();
+    }
+
+    // Share masked layer rasters with other server processes on this host
+    // through shared memory, keeping up to `bytes` of published and mapped
+    // rasters (0 disables). There is one segment per document content hash;
+    // the process that creates it sizes it to its own limit.
+    void setSharedCacheLimit(qint64 bytes)
+    {
+        sharedCacheLimit = bytes;
+    }
+
+    // Log hint edits made since the last save_hints to a .psd_journal file
+    // next to the PSD, so that recover_hints can bring them back after a crash
+    void setHintJournal(bool enabled)
+    {
+        hintJournalEnabled = enabled;
+    }
+
+    // Tool calls taking at least `thresholdMs` (0 disables) are appended to
+    // `fileName` with their phase timings, arguments and document stats
+    void setSlowLog(const QString &fileName, int thresholdMs)
+    {
+        slowLogFile = fileName;
+        slowThresholdMs = thresholdMs;
+    }
+
+    // Neither traced nor counted as activity, so polling it does not push
+    // real calls out of the call ring or keep the document alive
+    Q_INVOKABLE QString get_server_stats()
+    {
+        QJsonArray recent;
+        for (quint64 n = qMin<quint64>(callCount, 16); n > 0; --n)
+            recent.append(callRecordJson(callRing[(callCount - n) % callRing.size()]));
         return toJson(QJsonObject{
-            {"file"_L1, exporterModel.fileName()},
-            {"width"_L1, sz.width()},
-            {"height"_L1, sz.height()},
-            {"layerCount"_L1, countLayers({})}
+            {"uptime"_L1, uptime.elapsed() / 1000},
+            {"file"_L1, pendingState.isEmpty() ? exporterModel.fileName() : pendingState["path"_L1].toString()},
+            {"pendingRestore"_L1, !pendingState.isEmpty()},
+            {"layerCount"_L1, layerTable.size()},
+            {"cacheBytes"_L1, cacheBytes()},
+            {"idleSeconds"_L1, lastActivity.isValid() ? lastActivity.elapsed() / 1000 : uptime.elapsed() / 1000},
+            {"idle"_L1, QJsonObject{
+                {"releaseAfter"_L1, idleRelease},
+                {"evictAfter"_L1, idleEvict},
+                {"cacheReleases"_L1, cacheReleases},
+                {"evictions"_L1, evictions},
+                {"reloads"_L1, reloads},
+                {"reclaimedCacheBytes"_L1, reclaimedCacheBytes},
+                {"reclaimedDocumentBytes"_L1, reclaimedDocumentBytes},
+                {"reloadError"_L1, restoreError},
+            }},
+            {"calls"_L1, QJsonObject{
+                {"count"_L1, qint64(callCount)},
+                {"slow"_L1, qint64(slowCalls)},
+                {"slowThresholdMs"_L1, slowThresholdMs},
+                {"recent"_L1, recent},
+            }},
+            {"allocations"_L1, allocationStats()},
         });
     }
 
-    Q_INVOKABLE QString get_layer_tree()
+    Q_INVOKABLE QString get_memory_usage(int topN)
     {
+        CallTrace trace(this, "get_memory_usage", [&] { return QJsonObject{{"topN"_L1, topN}}; });
+        touch();
         if (exporterModel.fileName().isEmpty())
-            return toJson(QJsonObject{{"error"_L1, "No PSD file loaded"_L1}});
+            return noDocument();
+
+        // Images sharing pixel data (smart object copies, pooled assets) are counted once
+        QSet<qint64> seen;
+        const auto imageBytes = [&seen](const QImage &image) -> qint64 {
+            if (image.isNull() || seen.contains(image.cacheKey()))
+                return 0;
+            seen.insert(image.cacheKey());
+            return image.sizeInBytes();
+        };
 
-        QJsonArray tree;
-        buildTree({}, tree);
-        return toJson(QJsonObject{
+        struct LayerBytes
+        {
+            qint32 layerId;
+            QString name;
+            QSize size;
+            qint64 bytes;
+        };
+        // The pool goes first. Only the layer whose raster went into the pool
+        // shares it; every other layer placing the same asset still holds its
+        // own copy in layerRasters. Per-layer sizes in largestLayers are not
+        // deduplicated.
+        qint64 poolBytes = 0;
+        for (const auto &image : std::as_const(smartObjectPool))
+            poolBytes += imageBytes(image);
+
+        QList<LayerBytes> layers;
+        qint64 rasterBytes = 0;
+        qint64 maskBytes = 0;
+        for (const auto &entry : std::as_const(layerTable)) {
+            const auto *item = exporterModel.layerItem(entry.index);
+            if (!item)
+                continue;
+            rasterBytes += imageBytes(item->image());
+            maskBytes += imageBytes(item->transparencyMask()) + imageBytes(item->layerMask());
+            const qint64 bytes = item->image().sizeInBytes() + item->transparencyMask().sizeInBytes()
+                + item->layerMask().sizeInBytes();
+            if (bytes > 0)
+                layers.append({exporterModel.layerId(entry.index), entry.name, item->image().size(), bytes});
+        }
+
+        const auto count = qBound(0, topN > 0 ? topN : 10, int(layers.size()));
+        std::partial_sort(layers.begin(), layers.begin() + count, layers.end(),
+                          [](const LayerBytes &a, const LayerBytes &b) { return a.bytes > b.bytes; });
+        QJsonArray largest;
+        for (int i = 0; i < count; ++i) {
+            const auto &layer = layers.at(i);
+            largest.append(QJsonObject{
+                {"layerId"_L1, layer.layerId},
+                {"name"_L1, layer.name},
+                {"width"_L1, layer.size.width()},
+                {"height"_L1, layer.size.height()},
+                {"bytes"_L1, layer.bytes},
+            });
+        }
+
+        QJsonObject caches;
+        {
+            QMutexLocker locker(&cacheMutex);
+            caches = QJsonObject{
+                {"shapes"_L1, shapeCache.totalCost()},
+                {"mergedFolders"_L1, mergedCache.totalCost()},
+                {"effects"_L1, effectCache.totalCost()},
+                {"colorConversions"_L1, colorCache.totalCost()},
+                {"smartObjectRenditions"_L1, smartObjectCache.totalCost()},
+                {"glyphRuns"_L1, glyphCache.totalCost()},
+            };
+        }
+        {
+            QMutexLocker locker(&sharedMutex);
+            caches["sharedRasters"_L1] = sharedRasterBytes;
+        }
+        qint64 cacheTotal = 0;
+        for (const auto &value : std::as_const(caches))
+            cacheTotal += value.toInteger();
+
+        // Rough sizes of the index structures; QString payloads come from the pool
+        const qint64 indexBytes = layerTable.size() * qint64(sizeof(LayerEntry) + sizeof(qsizetype))
+            + layerSlots.size() * qint64(sizeof(qint32) + sizeof(qsizetype))
+            + hintJournal.size() * qint64(sizeof(HintEdit));
+        const qint64 stringBytes = strings.bytes();
+
+        QJsonObject result{
             {"file"_L1, exporterModel.fileName()},
-            {"layers"_L1, tree}
-        });
+            {"layerRasters"_L1, rasterBytes},
+            {"masks"_L1, maskBytes},
+            {"smartObjectPool"_L1, poolBytes},
+            {"caches"_L1, caches},
+            {"strings"_L1, stringBytes},
+            {"indexes"_L1, indexBytes},
+            {"total"_L1, rasterBytes + maskBytes + poolBytes + cacheTotal + stringBytes + indexBytes},
+            {"largestLayers"_L1, largest},
+        };
+
+#if defined(Q_OS_LINUX)
+        // Resident set size, for comparison with the accounted total
+        QFile statm(u"/proc/self/statm"_s);
+        if (statm.open(QIODevice::ReadOnly)) {
+            const auto fields = statm.readAll().split(' ');
+            if (fields.size() > 1)
+                result["rss"_L1] = fields.at(1).toLongLong() * qint64(sysconf(_SC_PAGESIZE));
+        }
+#endif
+        return toJson(result);
+    }
+
+    Q_INVOKABLE QString load_psd(const QString &path)
+    {
+        CallTrace trace(this, "load_psd", [&] { return QJsonObject{{"path"_L1, path}}; });
+        pendingState = {};
+        restoreError.clear();
+        touch();
+        return toJson(openDocument(path, {}, &trace));
+    }
+
+    Q_INVOKABLE QString get_layer_tree()
+    {
+        CallTrace trace(this, "get_layer_tree");
+        touch();
+        if (exporterModel.fileName().isEmpty())
+            return noDocument();
+
+        // Written directly as UTF-8; names come pre-encoded from the string pool
+        QByteArray out;
+        out.reserve(layerTable.size() * 96);
+        out += "{\"file\":";
+        appendJsonString(out, exporterModel.fileName());
+        out += ",\"generation\":";
+        out += QByteArray::number(hintGeneration);
+        out += ",\"layers\":";
+        writeTree({}, out);
+        out += '}';
+        trace.phase("serialize");
+        return QString::fromUtf8(out);
+    }
+
+    Q_INVOKABLE QString get_layer_tree_changes(int sinceGeneration)
+    {
+        CallTrace trace(this, "get_layer_tree_changes", [&] { return QJsonObject{{"sinceGeneration"_L1, sinceGeneration}}; });
+        touch();
+        if (exporterModel.fileName().isEmpty())
+            return noDocument();
+
+        // The layer structure only changes on load. A generation from before
+        // the current document, or older than the kept history, gets the full tree.
+        const auto since = quint64(qMax(sinceGeneration, 0));
+        const bool reset = since < loadGeneration
+            || (!treeChanges.isEmpty() && since + 1 < treeChanges.firstKey())
+            || since > hintGeneration;
+        if (reset) {
+            QByteArray out;
+            out.reserve(layerTable.size() * 96);
+            out += "{\"generation\":";
+            out += QByteArray::number(hintGeneration);
+            out += ",\"layers\":";
+            writeTree({}, out);
+            out += ",\"reset\":true}";
+            return QString::fromUtf8(out);
+        }
+
+        QSet<qint32> changed;
+        for (auto it = treeChanges.upperBound(since); it != treeChanges.cend(); ++it) {
+            for (const auto layerId : it.value())
+                changed.insert(layerId);
+        }
+        auto layerIds = changed.values();
+        std::sort(layerIds.begin(), layerIds.end());
+
+        QByteArray out;
+        out += "{\"generation\":";
+        out += QByteArray::number(hintGeneration);
+        out += ",\"modified\":[";
+        bool first = true;
+        for (const auto layerId : std::as_const(layerIds)) {
+            const auto index = findLayerById(layerId);
+            if (!index.isValid())
+                continue;
+            if (!first)
+                out += ',';
+            first = false;
+            writeNode(index, out, false);
+        }
+        out += "],\"reset\":false}";
+        return QString::fromUtf8(out);
     }
 
     Q_INVOKABLE QString get_layer_details(int layerId)
     {
+        CallTrace trace(this, "get_layer_details", [&] { return QJsonObject{{"layerId"_L1, layerId}}; });
+        touch();
         auto index = findLayerById(layerId);
         if (!index.isValid())
             return toJson(QJsonObject{{"error"_L1, u"Layer %1 not found"_s.arg(layerId)}});
 
         QJsonObject obj;
         obj["layerId"_L1] = exporterModel.layerId(index);
-        obj["name"_L1] = exporterModel.layerName(index);
+        obj["name"_L1] = layerTable.at(layerSlots.value(layerId)).name;
         const auto r = exporterModel.rect(index);
         obj["rect"_L1] = QJsonObject{
             {"x"_L1, r.x()}, {"y"_L1, r.y()},
@@ -269,6 +1183,9 @@ Build or preview to confirm the layout and interactions work correctly.
                 const auto lf = item->linkedFile();
                 if (!lf.name.isEmpty())
                     obj["linkedFile"_L1] = lf.name;
+                const auto soKey = smartObjectKeys.value(layerId);
+                if (!soKey.isEmpty())
+                    obj["linkedFileUsers"_L1] = smartObjectRefs.value(soKey);
                 break;
             }
             case QPsdAbstractLayerItem::Folder: {
@@ -288,7 +1205,7 @@ Build or preview to confirm the layout and interactions work correctly.
         }
 
         // Export hint
-        const auto hint = exporterModel.layerHint(index);
+        const auto &hint = hintOf(index);
         QJsonObject hintObj;
         hintObj["type"_L1] = hintTypeName(hint.type);
         if (!hint.id.isEmpty())
@@ -298,10 +1215,9 @@ Build or preview to confirm the layout and interactions work correctly.
         if (hint.type == QPsdExporterTreeItemModel::ExportHint::Native)
             hintObj["baseElement"_L1] = QPsdExporterTreeItemModel::ExportHint::nativeCode2Name(hint.baseElement);
         hintObj["visible"_L1] = hint.visible;
-        if (!hint.properties.isEmpty()) {
+        if (hint.hasProperties()) {
             QJsonArray propsArr;
-            for (const auto &prop : hint.properties)
-                propsArr.append(prop);
+            hint.forEachProperty([&propsArr](QStringView prop) { propsArr.append(prop.toString()); });
             hintObj["properties"_L1] = propsArr;
         }
         obj["exportHint"_L1] = hintObj;
@@ -311,61 +1227,383 @@ Build or preview to confirm the layout and interactions work correctly.
 
     Q_INVOKABLE QString set_export_hint(int layerId, const QString &type, const QString &options)
     {
+        CallTrace trace(this, "set_export_hint", [&] { return QJsonObject{{"layerId"_L1, layerId}, {"type"_L1, type}, {"options"_L1, options}}; });
+        touch();
         auto index = findLayerById(layerId);
         if (!index.isValid())
             return toJson(QJsonObject{{"error"_L1, u"Layer %1 not found"_s.arg(layerId)}});
 
-        static const QHash<QString, QPsdExporterTreeItemModel::ExportHint::Type> typeMap = {
-            {"embed"_L1,  QPsdExporterTreeItemModel::ExportHint::Embed},
-            {"merge"_L1,  QPsdExporterTreeItemModel::ExportHint::Merged},
-            {"custom"_L1, QPsdExporterTreeItemModel::ExportHint::Component},
-            {"native"_L1, QPsdExporterTreeItemModel::ExportHint::Native},
-            {"skip"_L1,   QPsdExporterTreeItemModel::ExportHint::Skip},
-        };
-
         const auto lower = type.toLower();
-        if (!typeMap.contains(lower))
+        if (!hintTypes().contains(lower))
             return toJson(QJsonObject{{"error"_L1, u"Unknown type: %1. Use: embed, merge, custom, native, skip"_s.arg(type)}});
 
         const auto opts = QJsonDocument::fromJson(options.toUtf8()).object();
 
         auto hint = exporterModel.layerHint(index);
-        hint.type = typeMap.value(lower);
-        if (opts.contains("id"_L1))
-            hint.id = opts["id"_L1].toString();
-        if (opts.contains("visible"_L1))
-            hint.visible = opts["visible"_L1].toBool();
-        if (opts.contains("componentName"_L1) && !opts["componentName"_L1].toString().isEmpty())
-            hint.componentName = opts["componentName"_L1].toString();
-        if (opts.contains("baseElement"_L1) && !opts["baseElement"_L1].toString().isEmpty())
-            hint.baseElement = QPsdExporterTreeItemModel::ExportHint::nativeName2Code(opts["baseElement"_L1].toString());
-        if (opts.contains("properties"_L1)) {
-            hint.properties.clear();
-            const auto propsArr = opts["properties"_L1].toArray();
-            for (const auto &val : propsArr)
-                hint.properties.insert(val.toString());
-        }
-
-        exporterModel.setLayerHint(index, hint);
+        applyHintOptions(hint, lower, opts);
+        setHint(index, hint);
+        endHintBatch();
 
+        const auto &stored = hintOf(index);
         QJsonArray propsArr;
-        for (const auto &prop : hint.properties)
-            propsArr.append(prop);
+        stored.forEachProperty([&propsArr](QStringView prop) { propsArr.append(prop.toString()); });
         return toJson(QJsonObject{
             {"layerId"_L1, layerId},
-            {"id"_L1, hint.id},
+            {"id"_L1, stored.id},
             {"type"_L1, lower},
-            {"componentName"_L1, hint.componentName},
-            {"baseElement"_L1, QPsdExporterTreeItemModel::ExportHint::nativeCode2Name(hint.baseElement)},
-            {"visible"_L1, hint.visible},
+            {"componentName"_L1, stored.componentName},
+            {"baseElement"_L1, QPsdExporterTreeItemModel::ExportHint::nativeCode2Name(stored.baseElement)},
+            {"visible"_L1, stored.visible},
             {"properties"_L1, propsArr},
         });
     }
 
+    Q_INVOKABLE QString suggest_hints(int layerId, bool apply)
+    {
+        CallTrace trace(this, "suggest_hints", [&] { return QJsonObject{{"layerId"_L1, layerId}, {"apply"_L1, apply}}; });
+        touch();
+        if (exporterModel.fileName().isEmpty())
+            return noDocument();
+
+        QModelIndex root;
+        if (layerId >= 0) {
+            root = findLayerById(layerId);
+            if (!root.isValid())
+                return toJson(QJsonObject{{"error"_L1, u"Layer %1 not found"_s.arg(layerId)}});
+        }
+
+        // Single pass over the subtree collecting every layer
+        QList<QModelIndex> layers;
+        if (root.isValid())
+            layers.append(root);
+        const std::function<void(const QModelIndex &)> walk = [&](const QModelIndex &parent) {
+            for (int row = 0; row < exporterModel.rowCount(parent); ++row) {
+                const auto index = exporterModel.index(row, 0, parent);
+                layers.append(index);
+                walk(index);
+            }
+        };
+        walk(root);
+
+        // Repeated folders and images (same appearance and size) become components
+        QList<QModelIndex> candidates;
+        for (const auto &index : layers) {
+            const auto *item = exporterModel.layerItem(index);
+            if (item && item->isVisible() && index != root
+                && (item->type() == QPsdAbstractLayerItem::Folder || item->type() == QPsdAbstractLayerItem::Image)) {
+                candidates.append(index);
+            }
+        }
+        QList<const LayerEntry *> candidateLayers;
+        for (const auto &index : std::as_const(candidates))
+            candidateLayers.append(entryOf(index));
+        const QList<QPair<quint64, QSize>> hashes = QtConcurrent::blockingMapped(&renderPool, candidateLayers,
+            [this](const LayerEntry *layer) { return perceptualHash(*layer); });
+        trace.phase("hash");
+
+        // Groups in tree order of their first member, so names are stable
+        QHash<QPair<quint64, quint64>, QList<QModelIndex>> groups;
+        QList<QPair<quint64, quint64>> groupOrder;
+        for (qsizetype i = 0; i < candidates.size(); ++i) {
+            const auto &[hash, size] = hashes.at(i);
+            // Blank and flat layers all hash to 0; that is no sign of a repeat
+            if (size.isEmpty() || hash == 0)
+                continue;
+            const QPair<quint64, quint64> key(hash, (quint64(size.width()) << 32) | quint32(size.height()));
+            auto &group = groups[key];
+            if (group.isEmpty())
+                groupOrder.append(key);
+            group.append(candidates.at(i));
+        }
+
+        // Component names already in the document are taken; colliding
+        // names get a number
+        QSet<QString> usedComponents;
+        for (const auto &entry : std::as_const(layerTable)) {
+            if (entry.hint.type == QPsdExporterTreeItemModel::ExportHint::Component && !entry.hint.componentName.isEmpty())
+                usedComponents.insert(entry.hint.componentName);
+        }
+        const auto uniqueComponent = [&usedComponents](const QString &name) {
+            const QString base = name.isEmpty() ? u"Component"_s : name;
+            QString componentName = base;
+            for (int n = 2; usedComponents.contains(componentName); ++n)
+                componentName = base + QString::number(n);
+            usedComponents.insert(componentName);
+            return componentName;
+        };
+        QString rootComponent;
+        const auto *rootItem = root.isValid() ? exporterModel.layerItem(root) : nullptr;
+        if (rootItem && rootItem->type() == QPsdAbstractLayerItem::Folder && !hintOf(root).isConfigured()) {
+            rootComponent = uniqueComponent(toPascalCase(exporterModel.layerName(root)));
+        }
+
+        // Repeats nested in a repeated component come with it
+        QSet<QModelIndex> repeated;
+        for (const auto &key : std::as_const(groupOrder)) {
+            const auto &group = groups[key];
+            if (group.size() > 1)
+                repeated.unite(QSet<QModelIndex>(group.cbegin(), group.cend()));
+        }
+        const auto nestedInRepeat = [&repeated](const QModelIndex &index) {
+            for (auto p = index.parent(); p.isValid(); p = p.parent()) {
+                if (repeated.contains(p))
+                    return true;
+            }
+            return false;
+        };
+        QHash<QModelIndex, QString> componentOf;
+        for (const auto &key : std::as_const(groupOrder)) {
+            const auto &group = groups[key];
+            if (group.size() < 2)
+                continue;
+            QList<QModelIndex> members;
+            for (const auto &index : group) {
+                if (!nestedInRepeat(index))
+                    members.append(index);
+            }
+            if (members.isEmpty())
+                continue;
+            const QString componentName = uniqueComponent(toPascalCase(exporterModel.layerName(group.first())));
+            for (const auto &index : std::as_const(members))
+                componentOf.insert(index, componentName);
+        }
+
+        static const QRegularExpression interactive(
+            u"(^|[^a-z])(btn|button|tab|toggle|switch|checkbox|radio|link|cta|nav)([^a-z]|$)"_s,
+            QRegularExpression::CaseInsensitiveOption);
+
+        QSet<QString> usedIds;
+        const auto uniqueId = [&usedIds](const QString &name) {
+            const QString base = name.isEmpty() ? u"layer"_s : name;
+            QString id = base;
+            for (int n = 2; usedIds.contains(id); ++n)
+                id = base + QString::number(n);
+            usedIds.insert(id);
+            return id;
+        };
+        for (const auto &index : std::as_const(layers)) {
+            const auto &id = hintOf(index).id;
+            if (!id.isEmpty())
+                usedIds.insert(id);
+        }
+
+        struct Proposal
+        {
+            QModelIndex index;
+            QString type;
+            QJsonObject options;
+            QString reason;
+        };
+        QList<Proposal> proposals;
+        for (const auto &index : std::as_const(layers)) {
+            const auto *item = exporterModel.layerItem(index);
+            if (!item || hintOf(index).isConfigured())
+                continue;
+            const auto name = exporterModel.layerName(index);
+
+            if (index == root && item->type() == QPsdAbstractLayerItem::Folder) {
+                proposals.append({index, u"custom"_s,
+                                  QJsonObject{{"componentName"_L1, rootComponent}}, u"root folder"_s});
+            } else if (componentOf.contains(index)) {
+                proposals.append({index, u"custom"_s,
+                                  QJsonObject{{"componentName"_L1, componentOf.value(index)}}, u"repeated element"_s});
+            } else if (interactive.match(name).hasMatch()) {
+                proposals.append({index, u"embed"_s,
+                                  QJsonObject{{"id"_L1, uniqueId(toCamelCase(name))}, {"baseElement"_L1, "TouchArea"_L1}},
+                                  u"interactive name"_s});
+            } else if (item->type() == QPsdAbstractLayerItem::Text) {
+                proposals.append({index, u"embed"_s,
+                                  QJsonObject{{"id"_L1, uniqueId(toCamelCase(name))}}, u"text label"_s});
+            }
+        }
+
+        // Apply all proposals in one step, after every one has been computed
+        if (apply) {
+            for (const auto &proposal : std::as_const(proposals)) {
+                auto hint = exporterModel.layerHint(proposal.index);
+                applyHintOptions(hint, proposal.type, proposal.options);
+                setHint(proposal.index, hint);
+            }
+            if (!proposals.isEmpty())
+                endHintBatch();
+        }
+
+        QJsonArray result;
+        for (const auto &proposal : std::as_const(proposals)) {
+            result.append(QJsonObject{
+                {"layerId"_L1, exporterModel.layerId(proposal.index)},
+                {"name"_L1, exporterModel.layerName(proposal.index)},
+                {"type"_L1, proposal.type},
+                {"options"_L1, proposal.options},
+                {"reason"_L1, proposal.reason},
+            });
+        }
+        return toJson(QJsonObject{
+            {"proposals"_L1, result},
+            {"applied"_L1, apply},
+        });
+    }
+
+    Q_INVOKABLE QString apply_hint_rules(const QString &rules, bool dryRun)
+    {
+        CallTrace trace(this, "apply_hint_rules", [&] { return QJsonObject{{"rules"_L1, rules}, {"dryRun"_L1, dryRun}}; });
+        touch();
+        if (exporterModel.fileName().isEmpty())
+            return noDocument();
+
+        // Compile every rule up front so that a bad rule rejects the whole batch
+        struct Rule
+        {
+            QRegularExpression name;
+            QRegularExpression parent;
+            int layerType = -1;
+            int minDepth = 0;
+            int maxDepth = std::numeric_limits<int>::max();
+            QString type;
+            QJsonObject options;
+        };
+        static const QHash<QString, int> layerTypes = {
+            {"text"_L1, QPsdAbstractLayerItem::Text},
+            {"shape"_L1, QPsdAbstractLayerItem::Shape},
+            {"image"_L1, QPsdAbstractLayerItem::Image},
+            {"folder"_L1, QPsdAbstractLayerItem::Folder},
+        };
+        const auto compilePattern = [](const QJsonObject &obj, const QString &globKey, const QString &regexKey) {
+            if (obj.contains(regexKey))
+                return QRegularExpression(obj[regexKey].toString());
+            if (obj.contains(globKey)) {
+                return QRegularExpression(QRegularExpression::wildcardToRegularExpression(
+                    obj[globKey].toString(), QRegularExpression::UnanchoredWildcardConversion).prepend(u'^').append(u'$'),
+                    QRegularExpression::CaseInsensitiveOption);
+            }
+            return QRegularExpression();
+        };
+
+        QList<Rule> compiled;
+        QJsonParseError parseError;
+        const auto rulesDoc = QJsonDocument::fromJson(rules.toUtf8(), &parseError);
+        if (parseError.error != QJsonParseError::NoError)
+            return toJson(QJsonObject{{"error"_L1, u"Invalid rules: %1 at offset %2"_s.arg(parseError.errorString()).arg(parseError.offset)}});
+        if (!rulesDoc.isArray())
+            return toJson(QJsonObject{{"error"_L1, "Invalid rules: expected a JSON array"_L1}});
+        const auto rulesArr = rulesDoc.array();
+        for (qsizetype i = 0; i < rulesArr.size(); ++i) {
+            const auto obj = rulesArr.at(i).toObject();
+            Rule rule;
+            rule.name = compilePattern(obj, u"name"_s, u"nameRegex"_s);
+            rule.parent = compilePattern(obj, u"parent"_s, u"parentRegex"_s);
+            if (!rule.name.isValid() || !rule.parent.isValid())
+                return toJson(QJsonObject{{"error"_L1, u"Rule %1: invalid pattern"_s.arg(i)}});
+            if (obj.contains("layerType"_L1)) {
+                rule.layerType = layerTypes.value(obj["layerType"_L1].toString().toLower(), -1);
+                if (rule.layerType < 0)
+                    return toJson(QJsonObject{{"error"_L1, u"Rule %1: unknown layerType. Use: text, shape, image, folder"_s.arg(i)}});
+            }
+            if (obj.contains("depth"_L1))
+                rule.minDepth = rule.maxDepth = obj["depth"_L1].toInt();
+            rule.minDepth = obj["minDepth"_L1].toInt(rule.minDepth);
+            rule.maxDepth = obj["maxDepth"_L1].toInt(rule.maxDepth);
+            rule.type = obj["type"_L1].toString().toLower();
+            if (!hintTypes().contains(rule.type))
+                return toJson(QJsonObject{{"error"_L1, u"Rule %1: unknown type. Use: embed, merge, custom, native, skip"_s.arg(i)}});
+            rule.options = obj["options"_L1].toObject();
+            compiled.append(rule);
+        }
+        if (compiled.isEmpty())
+            return toJson(QJsonObject{{"error"_L1, "No rules given"_L1}});
+        trace.phase("compile");
+
+        // `{name}`, `{camel}` and `{pascal}` in string options expand from the layer name
+        const auto expand = [](const QJsonObject &options, const QString &name) {
+            QJsonObject result = options;
+            for (auto it = result.begin(); it != result.end(); ++it) {
+                if (!it.value().isString())
+                    continue;
+                QString value = it.value().toString();
+                value.replace("{name}"_L1, name);
+                value.replace("{camel}"_L1, toCamelCase(name));
+                value.replace("{pascal}"_L1, toPascalCase(name));
+                it.value() = value;
+            }
+            return result;
+        };
+
+        // Ids must stay unique across the document. A layer gives up its
+        // own id before taking a new one, so re-running the rules keeps it.
+        QHash<QString, int> usedIds;
+        for (const auto &entry : std::as_const(layerTable)) {
+            if (!entry.hint.id.isEmpty())
+                ++usedIds[entry.hint.id];
+        }
+        const auto uniqueId = [&usedIds](const QString &ownId, const QString &name) {
+            if (!ownId.isEmpty() && --usedIds[ownId] == 0)
+                usedIds.remove(ownId);
+            QString id = name;
+            for (int n = 2; usedIds.contains(id); ++n)
+                id = name + QString::number(n);
+            ++usedIds[id];
+            return id;
+        };
+
+        // One pass over the tree; the first matching rule wins
+        QJsonArray touched;
+        const std::function<void(const QModelIndex &, int)> walk = [&](const QModelIndex &parent, int depth) {
+            const AllocScope scope(AllocPhase::TreeWalk);
+            const QString parentName = parent.isValid() ? exporterModel.layerName(parent) : QString();
+            for (int row = 0; row < exporterModel.rowCount(parent); ++row) {
+                const auto index = exporterModel.index(row, 0, parent);
+                const auto *item = exporterModel.layerItem(index);
+                const auto name = exporterModel.layerName(index);
+                for (qsizetype i = 0; item && i < compiled.size(); ++i) {
+                    const auto &rule = compiled.at(i);
+                    if (depth < rule.minDepth || depth > rule.maxDepth)
+                        continue;
+                    if (rule.layerType >= 0 && item->type() != rule.layerType)
+                        continue;
+                    if (!rule.name.pattern().isEmpty() && !rule.name.match(name).hasMatch())
+                        continue;
+                    if (!rule.parent.pattern().isEmpty() && !rule.parent.match(parentName).hasMatch())
+                        continue;
+
+                    auto options = expand(rule.options, name);
+                    const auto newId = options["id"_L1].toString();
+                    if (!newId.isEmpty())
+                        options["id"_L1] = uniqueId(hintOf(index).id, newId);
+                    if (!dryRun) {
+                        auto hint = exporterModel.layerHint(index);
+                        applyHintOptions(hint, rule.type, options);
+                        setHint(index, hint);
+                    }
+                    touched.append(QJsonObject{
+                        {"layerId"_L1, exporterModel.layerId(index)},
+                        {"name"_L1, name},
+                        {"rule"_L1, i},
+                        {"type"_L1, rule.type},
+                        {"options"_L1, options},
+                    });
+                    break;
+                }
+                walk(index, depth + 1);
+            }
+        };
+        walk({}, 0);
+        trace.phase("walk");
+
+        if (!dryRun && !touched.isEmpty())
+            endHintBatch();
+
+        return toJson(QJsonObject{
+            {"touched"_L1, touched},
+            {"dryRun"_L1, dryRun},
+        });
+    }
+
     Q_INVOKABLE QString do_export(const QString &format, const QString &outputDir, const QString &options)
     {
+        CallTrace trace(this, "do_export", [&] { return QJsonObject{{"format"_L1, format}, {"outputDir"_L1, outputDir}, {"options"_L1, options}}; });
+        touch();
         if (exporterModel.fileName().isEmpty())
-            return toJson(QJsonObject{{"error"_L1, "No PSD file loaded"_L1}});
+            return noDocument();
 
         auto *plugin = QPsdExporterPlugin::plugin(format.toUtf8());
         if (!plugin)
@@ -385,20 +1623,85 @@ Build or preview to confirm the layout and interactions work correctly.
         config.fontScaleFactor = opts["fontScaleFactor"_L1].toDouble(1.0);
         config.imageScaling = opts["imageScaling"_L1].toBool(false);
         config.makeCompact = opts["makeCompact"_L1].toBool(false);
+        const bool vectorShapes = opts["vectorShapes"_L1].toBool(false);
 
-        if (!plugin->exportTo(&exporterModel, outputDir, config))
-            return toJson(QJsonObject{{"error"_L1, "Export failed"_L1}});
+        if (!opts["async"_L1].toBool(false)) {
+            if (const auto busy = exportBusy(); !busy.isEmpty())
+                return busy;
+            return toJson(runExport(&exporterModel, plugin, format, outDir, config, vectorShapes));
+        }
 
+        // Admission control: a bounded number of exports may wait or run
+        pruneExportJobs();
+        qsizetype pending = 0;
+        for (const auto &job : std::as_const(exportJobs))
+            pending += job.future.isFinished() ? 0 : 1;
+        if (pending >= MaxPendingExports)
+            return toJson(QJsonObject{{"error"_L1, u"Export queue is full (%1 jobs); try again later"_s.arg(pending)}});
+
+        // The job exports the hints as they are now; later edits do not affect it
+        QHash<qint32, QPsdExporterTreeItemModel::ExportHint> hints;
+        for (const auto &entry : std::as_const(layerTable))
+            hints.insert(exporterModel.layerId(entry.index), exporterModel.layerHint(entry.index));
+        const auto fileName = exporterModel.fileName();
+        const auto size = documentSize;
+        const auto modified = documentModified;
+
+        const int jobId = ++lastExportJob;
+        exportJobs.insert(jobId, {format, outputDir,
+                                  QtConcurrent::run(&batchPool, [plugin, format, fileName, size, modified, hints, outDir, config, vectorShapes] {
+                                      const QFileInfo info(fileName);
+                                      if (info.size() != size || info.lastModified() != modified)
+                                          return QJsonObject{{"error"_L1, "The PSD changed on disk since it was loaded"_L1}};
+                                      // The item models are not thread-safe, so the job
+                                      // parses a copy of the document of its own
+                                      QPsdGuiLayerTreeItemModel gui;
+                                      QPsdExporterTreeItemModel model;
+                                      model.setSourceModel(&gui);
+                                      model.load(fileName);
+                                      if (const auto err = model.errorMessage(); !err.isEmpty())
+                                          return QJsonObject{{"error"_L1, err}};
+                                      if (restoreHints(&model, {}, hints) != hints.size())
+                                          return QJsonObject{{"error"_L1, "The PSD changed on disk since it was loaded"_L1}};
+                                      return runExport(&model, plugin, format, outDir, config, vectorShapes);
+                                  })});
         return toJson(QJsonObject{
-            {"format"_L1, format},
-            {"outputDir"_L1, outputDir},
-            {"width"_L1, w},
-            {"height"_L1, h},
+            {"jobId"_L1, jobId},
+            {"state"_L1, "queued"_L1},
         });
     }
 
+    Q_INVOKABLE QString get_export_status(int jobId)
+    {
+        CallTrace trace(this, "get_export_status", [&] { return QJsonObject{{"jobId"_L1, jobId}}; });
+        touch();
+        QJsonArray jobs;
+        for (auto it = exportJobs.cbegin(); it != exportJobs.cend(); ++it) {
+            if (jobId > 0 && it.key() != jobId)
+                continue;
+            const auto &job = it.value();
+            QJsonObject obj{
+                {"jobId"_L1, it.key()},
+                {"format"_L1, job.format},
+                {"outputDir"_L1, job.outputDir},
+            };
+            if (job.future.isFinished()) {
+                obj["state"_L1] = "finished"_L1;
+                obj["result"_L1] = job.future.result();
+            } else {
+                obj["state"_L1] = job.future.isStarted() ? "running"_L1 : "queued"_L1;
+            }
+            jobs.append(obj);
+        }
+        if (jobId > 0 && jobs.isEmpty())
+            return toJson(QJsonObject{{"error"_L1, u"Export job %1 not found"_s.arg(jobId)}});
+        return toJson(QJsonObject{{"jobs"_L1, jobs}});
+    }
+
     Q_INVOKABLE QString list_exporters()
     {
+        CallTrace trace(this, "list_exporters");
+        touch();
         QJsonArray arr;
         for (const auto &key : QPsdExporterPlugin::keys()) {
             auto *plugin = QPsdExporterPlugin::plugin(key);
@@ -411,266 +1714,2882 @@ Build or preview to confirm the layout and interactions work correctly.
                      ? "directory"_L1 : "file"_L1},
             });
         }
-        return toJson(QJsonObject{{"exporters"_L1, arr}});
+        return toJson(QJsonObject{{"exporters"_L1, arr}});
+    }
+
+    Q_INVOKABLE QString save_hints()
+    {
+        CallTrace trace(this, "save_hints");
+        touch();
+        if (exporterModel.fileName().isEmpty())
+            return noDocument();
+
+        // QtPsd writes the sidecar in full; the crash log it supersedes,
+        // including edits never recovered, goes away
+        const auto pending = unsavedLayers.size();
+        const bool write = pending > 0 || journalRecords > 0 || !QFile::exists(exporterModel.fileName() + "_"_L1);
+        QJsonObject result{
+            {"saved"_L1, true},
+            {"written"_L1, write},
+            {"layers"_L1, pending},
+        };
+        if (write) {
+            exporterModel.save();
+            QFile::remove(journalPath());
+            journalRecords = 0;
+            if (journalPending > 0)
+                result["journalDiscarded"_L1] = journalPending;
+            journalPending = 0;
+        }
+        unsavedLayers.clear();
+        scheduleSession();
+        return toJson(result);
+    }
+
+    Q_INVOKABLE QString recover_hints()
+    {
+        CallTrace trace(this, "recover_hints");
+        touch();
+        if (exporterModel.fileName().isEmpty())
+            return noDocument();
+        if (journalPending == 0)
+            return toJson(QJsonObject{{"error"_L1, "No unsaved hint edits to recover"_L1}});
+
+        // The last record for a layer wins; the replay is one undo step
+        QMap<qint32, QJsonObject> hints;
+        for (const auto &record : readHintJournal())
+            hints.insert(record["layerId"_L1].toInt(-1), record["hint"_L1].toObject());
+        journalPending = 0;
+        QJsonArray ids;
+        for (auto it = hints.cbegin(); it != hints.cend(); ++it) {
+            const auto index = findLayerById(it.key());
+            if (!index.isValid() || hintToJson(exporterModel.layerHint(index)) == it.value())
+                continue;
+            setHint(index, hintFromJson(it.value()));
+            ids.append(it.key());
+        }
+        if (!ids.isEmpty())
+            endHintBatch();
+        return toJson(QJsonObject{
+            {"recovered"_L1, ids.size()},
+            {"layerIds"_L1, ids},
+        });
+    }
+
+    Q_INVOKABLE QString undo_hints(int steps, const QString &checkpoint)
+    {
+        CallTrace trace(this, "undo_hints", [&] { return QJsonObject{{"steps"_L1, steps}, {"checkpoint"_L1, checkpoint}}; });
+        touch();
+        if (exporterModel.fileName().isEmpty())
+            return noDocument();
+
+        qsizetype target = journalHead;
+        if (!checkpoint.isEmpty()) {
+            if (!hintCheckpoints.contains(checkpoint))
+                return toJson(QJsonObject{{"error"_L1, u"Unknown checkpoint: %1"_s.arg(checkpoint)}});
+            target = hintCheckpoints.value(checkpoint);
+            if (target > journalHead)
+                return toJson(QJsonObject{{"error"_L1, u"Checkpoint %1 is ahead; use redo_hints"_s.arg(checkpoint)}});
+        } else {
+            for (int n = 0; n < qMax(steps, 1) && target > 0; ++n) {
+                const auto batch = hintJournal.at(target - 1).batch;
+                while (target > 0 && hintJournal.at(target - 1).batch == batch)
+                    --target;
+            }
+        }
+        return moveJournalHead(target);
+    }
+
+    Q_INVOKABLE QString redo_hints(int steps, const QString &checkpoint)
+    {
+        CallTrace trace(this, "redo_hints", [&] { return QJsonObject{{"steps"_L1, steps}, {"checkpoint"_L1, checkpoint}}; });
+        touch();
+        if (exporterModel.fileName().isEmpty())
+            return noDocument();
+
+        qsizetype target = journalHead;
+        if (!checkpoint.isEmpty()) {
+            if (!hintCheckpoints.contains(checkpoint))
+                return toJson(QJsonObject{{"error"_L1, u"Unknown checkpoint: %1"_s.arg(checkpoint)}});
+            target = hintCheckpoints.value(checkpoint);
+            if (target < journalHead)
+                return toJson(QJsonObject{{"error"_L1, u"Checkpoint %1 is behind; use undo_hints"_s.arg(checkpoint)}});
+        } else {
+            for (int n = 0; n < qMax(steps, 1) && target < hintJournal.size(); ++n) {
+                const auto batch = hintJournal.at(target).batch;
+                while (target < hintJournal.size() && hintJournal.at(target).batch == batch)
+                    ++target;
+            }
+        }
+        return moveJournalHead(target);
+    }
+
+    Q_INVOKABLE QString checkpoint_hints(const QString &name)
+    {
+        CallTrace trace(this, "checkpoint_hints", [&] { return QJsonObject{{"name"_L1, name}}; });
+        touch();
+        if (exporterModel.fileName().isEmpty())
+            return noDocument();
+
+        if (!name.isEmpty()) {
+            hintCheckpoints.insert(name, journalHead);
+            scheduleSession();
+        }
+
+        QJsonObject checkpoints;
+        for (auto it = hintCheckpoints.cbegin(); it != hintCheckpoints.cend(); ++it)
+            checkpoints[it.key()] = it.value();
+        return toJson(QJsonObject{
+            {"position"_L1, journalHead},
+            {"checkpoints"_L1, checkpoints},
+        });
+    }
+
+    // `options` may be left out; callers from before it existed pass only layerId
+    Q_INVOKABLE QImage get_layer_image(int layerId, const QString &options = QString())
+    {
+        CallTrace trace(this, "get_layer_image", [&] { return QJsonObject{{"layerId"_L1, layerId}, {"options"_L1, options}}; });
+        touch();
+        const auto it = layerSlots.constFind(layerId);
+        if (it == layerSlots.cend())
+            return {};
+
+        const auto opts = QJsonDocument::fromJson(options.toUtf8()).object();
+        return renderLayer(layerTable.at(*it), RenderOptions::fromJson(opts));
+    }
+
+    Q_INVOKABLE QImage render_layers(const QString &layerIds, int parentId, const QString &options)
+    {
+        CallTrace trace(this, "render_layers", [&] { return QJsonObject{{"layerIds"_L1, layerIds}, {"parentId"_L1, parentId}, {"options"_L1, options}}; });
+        touch();
+        lastContactSheet = {};
+        if (exporterModel.fileName().isEmpty())
+            return {};
+
+        QList<QModelIndex> indexes;
+        const auto ids = QJsonDocument::fromJson(layerIds.toUtf8()).array();
+        if (!ids.isEmpty()) {
+            for (const auto &id : ids) {
+                const auto index = findLayerById(id.toInt());
+                if (index.isValid())
+                    indexes.append(index);
+            }
+        } else {
+            const auto parent = findLayerById(parentId);
+            if (!parent.isValid())
+                return {};
+            for (int row = 0; row < exporterModel.rowCount(parent); ++row)
+                indexes.append(exporterModel.index(row, 0, parent));
+        }
+        if (indexes.isEmpty())
+            return {};
+        // Image tools cannot return an error; get_contact_sheet_map reports it
+        if (indexes.size() > MaxSheetCells) {
+            lastContactSheet = {{"error"_L1, u"Too many layers for one contact sheet: %1 (at most %2)"_s
+                                                  .arg(indexes.size()).arg(MaxSheetCells)}};
+            return {};
+        }
+
+        const auto opts = QJsonDocument::fromJson(options.toUtf8()).object();
+        const int cellSize = qBound(16, opts["cellSize"_L1].toInt(128), MaxCellSize);
+        const bool labels = opts["labels"_L1].toBool(true);
+        const int count = indexes.size();
+        int columns = opts["columns"_L1].toInt(0);
+        if (columns <= 0)
+            columns = qCeil(qSqrt(qreal(count)));
+        columns = qMin(columns, count);
+        const int rows = (count + columns - 1) / columns;
+
+        constexpr int padding = 4;
+        QFont labelFont;
+        labelFont.setPixelSize(11);
+        const QFontMetrics fm(labelFont);
+        const int labelHeight = labels ? fm.height() + padding : 0;
+        const int cellWidth = cellSize + padding * 2;
+        const int cellHeight = cellSize + padding * 2 + labelHeight;
+        const qint64 pixels = qint64(columns) * cellWidth * rows * cellHeight;
+        if (pixels > MaxSheetPixels) {
+            lastContactSheet = {{"error"_L1, u"Contact sheet too large: %1 megapixels (at most %2); use a smaller cellSize or fewer layers"_s
+                                                  .arg(pixels / 1000000).arg(MaxSheetPixels / 1000000)}};
+            return {};
+        }
+
+        // Workers only read the layer table, which changes on the main thread
+        // alone, and that waits here
+        QList<const LayerEntry *> layers;
+        for (const auto &index : std::as_const(indexes))
+            layers.append(entryOf(index));
+        const RenderOptions renderOptions = RenderOptions::fromJson(opts);
+        const QList<QImage> images = QtConcurrent::blockingMapped(&renderPool, layers,
+            [this, &renderOptions](const LayerEntry *layer) { return renderLayer(*layer, renderOptions); });
+        trace.phase("render");
+
+        QImage sheet(columns * cellWidth, rows * cellHeight, QImage::Format_ARGB32);
+        sheet.fill(Qt::white);
+
+        QPainter painter(&sheet);
+        painter.setRenderHint(QPainter::SmoothPixmapTransform);
+        painter.setFont(labelFont);
+
+        QJsonArray cells;
+        for (int i = 0; i < count; ++i) {
+            const QRect cell((i % columns) * cellWidth, (i / columns) * cellHeight, cellWidth, cellHeight);
+            const QRect imageArea(cell.x() + padding, cell.y() + padding, cellSize, cellSize);
+            painter.fillRect(imageArea, QColor(0xee, 0xee, 0xee));
+
+            // Fit the layer into its cell, never upscaling small layers
+            QRect target;
+            const QImage &image = images.at(i);
+            if (!image.isNull()) {
+                QSize size = image.size();
+                if (size.width() > cellSize || size.height() > cellSize)
+                    size.scale(cellSize, cellSize, Qt::KeepAspectRatio);
+                target = QRect(QPoint(), size);
+                target.moveCenter(imageArea.center());
+                painter.drawImage(target, image);
+            }
+
+            const auto layerId = exporterModel.layerId(indexes.at(i));
+            const auto name = exporterModel.layerName(indexes.at(i));
+            if (labels) {
+                const QRect labelRect(cell.x() + padding, imageArea.bottom() + 1,
+                                      cellSize, labelHeight);
+                painter.setPen(Qt::black);
+                painter.drawText(labelRect, Qt::AlignLeft | Qt::AlignVCenter,
+                                 fm.elidedText(u"%1: %2"_s.arg(layerId).arg(name), Qt::ElideRight, cellSize));
+            }
+
+            cells.append(QJsonObject{
+                {"layerId"_L1, layerId},
+                {"name"_L1, name},
+                {"cell"_L1, QJsonObject{
+                    {"x"_L1, cell.x()}, {"y"_L1, cell.y()},
+                    {"width"_L1, cell.width()}, {"height"_L1, cell.height()}
+                }},
+                {"image"_L1, QJsonObject{
+                    {"x"_L1, target.x()}, {"y"_L1, target.y()},
+                    {"width"_L1, target.width()}, {"height"_L1, target.height()}
+                }},
+                {"originalWidth"_L1, image.width()},
+                {"originalHeight"_L1, image.height()},
+            });
+        }
+        painter.end();
+
+        lastContactSheet = QJsonObject{
+            {"width"_L1, sheet.width()},
+            {"height"_L1, sheet.height()},
+            {"columns"_L1, columns},
+            {"rows"_L1, rows},
+            {"cellSize"_L1, cellSize},
+            {"cells"_L1, cells},
+        };
+        sheet.setText("cells"_L1, toJson(lastContactSheet));
+        return sheet;
+    }
+
+    Q_INVOKABLE QString get_contact_sheet_map()
+    {
+        CallTrace trace(this, "get_contact_sheet_map");
+        touch();
+        // After a refused render_layers call this holds its error
+        if (lastContactSheet.isEmpty())
+            return toJson(QJsonObject{{"error"_L1, "No contact sheet rendered"_L1}});
+        return toJson(lastContactSheet);
+    }
+
+    Q_INVOKABLE QString infer_layout(int layerId, const QString &options)
+    {
+        CallTrace trace(this, "infer_layout", [&] { return QJsonObject{{"layerId"_L1, layerId}, {"options"_L1, options}}; });
+        touch();
+        auto parent = findLayerById(layerId);
+        if (!parent.isValid())
+            return toJson(QJsonObject{{"error"_L1, u"Layer %1 not found"_s.arg(layerId)}});
+
+        const auto opts = QJsonDocument::fromJson(options.toUtf8()).object();
+        const int tolerance = qMax(0, opts["tolerance"_L1].toInt(2));
+
+        QList<LayoutItem> items;
+        for (int row = 0; row < exporterModel.rowCount(parent); ++row) {
+            auto index = exporterModel.index(row, 0, parent);
+            const auto *item = exporterModel.layerItem(index);
+            if (!item || !item->isVisible())
+                continue;
+            const QRect r = item->type() == QPsdAbstractLayerItem::Folder
+                ? computeBoundingRect(*entryOf(index), false) : item->rect();
+            if (!r.isEmpty())
+                items.append({exporterModel.layerId(index), r});
+        }
+
+        QJsonObject result{
+            {"layerId"_L1, layerId},
+            {"childCount"_L1, items.size()},
+        };
+
+        int stackedRows = 0;
+        int stackedColumns = 0;
+        const auto rowBands = sweepBands(items, Qt::Horizontal);
+        const auto columnBands = sweepBands(items, Qt::Vertical);
+        for (const auto orientation : {Qt::Horizontal, Qt::Vertical}) {
+            const auto &bands = orientation == Qt::Horizontal ? rowBands : columnBands;
+            QJsonArray stacks;
+            for (const auto &band : bands) {
+                if (band.size() < 2)
+                    continue;
+                const auto stack = describeStack(band, orientation, tolerance);
+                if (!stack.isEmpty())
+                    stacks.append(stack);
+            }
+            (orientation == Qt::Horizontal ? stackedRows : stackedColumns) = stacks.size();
+            result[orientation == Qt::Horizontal ? "rows"_L1 : "columns"_L1] = stacks;
+        }
+
+        // A grid is a set of rows and columns that partition all children
+        if (rowBands.size() >= 2 && columnBands.size() >= 2
+            && rowBands.size() * columnBands.size() == items.size()
+            && stackedRows == rowBands.size() && stackedColumns == columnBands.size()) {
+            result["grid"_L1] = QJsonObject{
+                {"rows"_L1, rowBands.size()},
+                {"columns"_L1, columnBands.size()},
+            };
+        }
+
+        QJsonArray guides;
+        collectGuides(items, Qt::Horizontal, tolerance, guides);
+        collectGuides(items, Qt::Vertical, tolerance, guides);
+        result["guides"_L1] = guides;
+
+        return toJson(result);
+    }
+
+    Q_INVOKABLE QString get_fonts_used()
+    {
+        CallTrace trace(this, "get_fonts_used");
+        touch();
+        if (exporterModel.fileName().isEmpty())
+            return noDocument();
+
+        QJsonArray fonts;
+        QMutexLocker locker(&fontMutex);
+        for (const auto &fontName : std::as_const(fontNames)) {
+            const auto resolved = QPsdFontMapper::instance()->resolveFont(fontName, exporterModel.fileName());
+            fonts.append(QJsonObject{
+                {"psdFont"_L1, fontName},
+                {"resolvedFont"_L1, strings.intern(resolved.family())},
+                {"resolvedStyle"_L1, resolved.styleName()},
+            });
+        }
+        return toJson(QJsonObject{{"fonts"_L1, fonts}});
+    }
+
+    Q_INVOKABLE QString get_font_mappings()
+    {
+        CallTrace trace(this, "get_font_mappings");
+        touch();
+        if (exporterModel.fileName().isEmpty())
+            return noDocument();
+
+        QMutexLocker locker(&fontMutex);
+        auto *mapper = QPsdFontMapper::instance();
+
+        QJsonObject global;
+        const auto globalMap = mapper->globalMappings();
+        for (auto it = globalMap.cbegin(); it != globalMap.cend(); ++it)
+            global[it.key()] = it.value();
+
+        QJsonObject context;
+        const auto contextMap = mapper->contextMappings(exporterModel.fileName());
+        for (auto it = contextMap.cbegin(); it != contextMap.cend(); ++it)
+            context[it.key()] = it.value();
+
+        return toJson(QJsonObject{
+            {"global"_L1, global},
+            {"context"_L1, context},
+        });
+    }
+
+    Q_INVOKABLE QString set_font_mapping(const QString &fromFont, const QString &toFont, bool global)
+    {
+        CallTrace trace(this, "set_font_mapping", [&] { return QJsonObject{{"fromFont"_L1, fromFont}, {"toFont"_L1, toFont}, {"global"_L1, global}}; });
+        touch();
+        if (const auto busy = exportBusy(); !busy.isEmpty())
+            return busy;
+        if (exporterModel.fileName().isEmpty())
+            return noDocument();
+
+        QMutexLocker fontLocker(&fontMutex);
+        auto *mapper = QPsdFontMapper::instance();
+
+        if (global) {
+            if (toFont.isEmpty())
+                mapper->removeGlobalMapping(fromFont);
+            else
+                mapper->setGlobalMapping(fromFont, toFont);
+            mapper->saveGlobalMappings();
+        } else {
+            auto mappings = mapper->contextMappings(exporterModel.fileName());
+            if (toFont.isEmpty())
+                mappings.remove(fromFont);
+            else
+                mappings[fromFont] = toFont;
+            mapper->setContextMappings(exporterModel.fileName(), mappings);
+            updateContextFonts();
+            scheduleSession();
+        }
+        fontLocker.unlock();
+
+        // Mapped text previews depend on the resolved fonts
+        {
+            QMutexLocker locker(&cacheMutex);
+            resolvedFonts.clear();
+            glyphCache.clear();
+            mergedCache.clear();
+            effectCache.clear();
+        }
+
+        return toJson(QJsonObject{
+            {"fromFont"_L1, fromFont},
+            {"toFont"_L1, toFont},
+            {"global"_L1, global},
+        });
+    }
+
+    Q_INVOKABLE QString batch_call(const QString &calls)
+    {
+        CallTrace trace(this, "batch_call", [&] { return QJsonObject{{"calls"_L1, calls}}; });
+        const auto doc = QJsonDocument::fromJson(calls.toUtf8());
+        if (!doc.isArray())
+            return toJson(QJsonObject{{"error"_L1, "calls must be a JSON array"_L1}});
+
+        // Results are already JSON, so they are spliced in without re-parsing
+        const auto &table = dispatchTable();
+        QByteArray out = "{\"results\":[";
+        bool first = true;
+        for (const auto &value : doc.array()) {
+            const auto call = value.toObject();
+            const auto tool = call["tool"_L1].toString();
+            const auto it = table.constFind(tool);
+            if (!first)
+                out += ',';
+            first = false;
+            if (it == table.cend())
+                out += toJson(QJsonObject{{"error"_L1, u"Unknown or unbatchable tool: %1"_s.arg(tool)}}).toUtf8();
+            else
+                out += (*it)(this, call["args"_L1].toObject()).toUtf8();
+        }
+        out += "]}";
+        trace.phase("dispatch");
+        return QString::fromUtf8(out);
+    }
+
+    QHash<QString, QString> toolDescriptions() const override
+    {
+        // Built once; returning the implicitly shared hash is a reference count bump
+        static const QHash<QString, QString> descriptions = {
+            {"load_psd"_L1, "Load a PSD file for inspection and export"_L1},
+            {"load_psd/path"_L1, "Absolute path to the PSD file"_L1},
+
+            {"get_layer_tree"_L1, "Get the layer tree structure of the loaded PSD file, with the document generation"_L1},
+
+            {"get_layer_tree_changes"_L1, "Get only the layers whose export hints changed since a generation returned by get_layer_tree or an earlier call. Returns the full tree with reset=true if the document was reloaded since"_L1},
+            {"get_layer_tree_changes/sinceGeneration"_L1, "The generation the caller's copy of the tree is at"_L1},
+
+            {"get_layer_details"_L1, "Get detailed information about a specific layer"_L1},
+            {"get_layer_details/layerId"_L1, "Layer ID to inspect"_L1},
+
+            {"set_export_hint"_L1, "Configure how a layer should be exported"_L1},
+            {"set_export_hint/layerId"_L1, "Layer ID to configure"_L1},
+            {"set_export_hint/type"_L1, "Export type: embed, merge, custom, native, skip"_L1},
+            {"set_export_hint/options"_L1, "JSON object with optional keys: id (string, identifier for binding — empty string to clear), visible (bool), componentName (string, for custom type), baseElement (string: Container, TouchArea, Button, Button_Highlighted, for native type), properties (array of strings: visible, color, position, text, size, image — controls which attributes are exported as bindable properties)"_L1},
+
+            {"suggest_hints"_L1, "Propose export hints for a subtree in one pass (root component, repeated elements as components, interactive names as TouchArea, text labels with ids), optionally applying them all at once"_L1},
+            {"suggest_hints/layerId"_L1, "Root layer ID to analyze, or -1 for the whole document"_L1},
+            {"suggest_hints/apply"_L1, "If true, apply all proposals atomically; if false, only return them"_L1},
+
+            {"apply_hint_rules"_L1, "Apply export hints by naming-convention rules in a single tree pass; the first matching rule wins for each layer"_L1},
+            {"apply_hint_rules/rules"_L1, "JSON array of rules. Each rule has match keys name (glob) or nameRegex, parent (glob) or parentRegex, layerType (text, shape, image, folder), depth / minDepth / maxDepth (0 = top level), and the hint: type (as in set_export_hint) and options (as in set_export_hint; {name}, {camel} and {pascal} expand from the layer name)"_L1},
+            {"apply_hint_rules/dryRun"_L1, "If true, only report the layers the rules would touch"_L1},
+
+            {"do_export"_L1, "Export the loaded PSD to a target format and directory"_L1},
+            {"do_export/format"_L1, "Exporter plugin key (use list_exporters to see available ones)"_L1},
+            {"do_export/outputDir"_L1, "Absolute path to the output directory"_L1},
+            {"do_export/options"_L1, "JSON object with optional keys: width (int), height (int), fontScaleFactor (double), imageScaling (bool), makeCompact (bool), vectorShapes (bool, also write visible path shape layers as SVG files under vectors/; the exporter output is unchanged), async (bool, run in the background and return a jobId for get_export_status; the job parses its own copy of the PSD, which takes as long and as much memory again as load_psd, and fails if the file changed since it was loaded). Width/height 0 or omitted = original size"_L1},
+
+            {"get_export_status"_L1, "Get the state (queued, running, finished) and result of background exports started with do_export async"_L1},
+            {"get_export_status/jobId"_L1, "Export job ID; 0 to list all recent jobs"_L1},
+
+            {"list_exporters"_L1, "List all available exporter plugins"_L1},
+
+            {"save_hints"_L1, "Persist export hints to the .psd_ sidecar file next to the PSD"_L1},
+
+            {"recover_hints"_L1, "Apply the unsaved hint edits that load_psd reported as journalPending, as one undo step"_L1},
+
+            {"undo_hints"_L1, "Undo export hint edits. Each tool call that changed hints is one step"_L1},
+            {"undo_hints/steps"_L1, "Number of steps to undo (default 1)"_L1},
+            {"undo_hints/checkpoint"_L1, "Checkpoint name to go back to instead of counting steps; empty to use steps"_L1},
+
+            {"redo_hints"_L1, "Redo export hint edits undone by undo_hints"_L1},
+            {"redo_hints/steps"_L1, "Number of steps to redo (default 1)"_L1},
+            {"redo_hints/checkpoint"_L1, "Checkpoint name to go forward to instead of counting steps; empty to use steps"_L1},
+
+            {"checkpoint_hints"_L1, "Name the current export hint state for undo_hints/redo_hints, and list all checkpoints"_L1},
+            {"checkpoint_hints/name"_L1, "Checkpoint name; empty to only list"_L1},
+
+            {"get_layer_image"_L1, "Get the rendered image of a specific layer"_L1},
+            {"get_layer_image/layerId"_L1, "Layer ID to get the image from"_L1},
+            {"get_layer_image/options"_L1, "Optional JSON object with optional keys: scale (double, default 1.0, max 8.0), text (string: raster (default) draws the PSD's baked text, mapped re-lays-out text with the fonts from set_font_mapping). Shape layers are rasterized from their vector path at the requested scale"_L1},
+
+            {"render_layers"_L1, "Render up to 256 layers into one labeled contact-sheet image of at most 32 megapixels. Use get_contact_sheet_map for the cell positions, or the error if the sheet was refused"_L1},
+            {"render_layers/layerIds"_L1, "JSON array of layer IDs (e.g. [12, 15, 20]); empty to use the children of parentId"_L1},
+            {"render_layers/parentId"_L1, "Folder layer ID whose children are rendered when layerIds is empty"_L1},
+            {"render_layers/options"_L1, "JSON object with optional keys: cellSize (int, default 128, 16 to 1024), columns (int, 0 or omitted = square grid), labels (bool, default true), scale and text (as in get_layer_image)"_L1},
+
+            {"get_contact_sheet_map"_L1, "Get the cell positions of the last contact sheet rendered by render_layers"_L1},
+
+            {"infer_layout"_L1, "Detect rows, columns, grids, alignment guides and spacing among the children of a folder"_L1},
+            {"infer_layout/layerId"_L1, "Folder layer ID to analyze"_L1},
+            {"infer_layout/options"_L1, "JSON object with optional keys: tolerance (int, pixels, default 2) used when comparing edges and gaps"_L1},
+
+            {"get_server_stats"_L1, "Get server statistics: uptime, idle time, cache bytes, what idle reclamation has released so far, recent call timings, and allocation counts when built with MCP_PSD2X_ALLOC_PROFILING"_L1},
+
+            {"get_memory_usage"_L1, "Get the memory used by the loaded document in bytes per category (layer rasters, masks, smart object pool, each cache, strings, indexes) with the largest layers"_L1},
+            {"get_memory_usage/topN"_L1, "Number of largest layers to list (default 10)"_L1},
+
+            {"get_fonts_used"_L1, "List all fonts used in the loaded PSD file with their resolved mappings"_L1},
+
+            {"get_font_mappings"_L1, "Get current font mapping settings (global and per-PSD context)"_L1},
+
+            {"set_font_mapping"_L1, "Set or remove a font mapping"_L1},
+            {"set_font_mapping/fromFont"_L1, "Original font name from PSD (e.g. MyriadPro-Bold)"_L1},
+            {"set_font_mapping/toFont"_L1, "Target font name to map to (empty string to remove mapping)"_L1},
+            {"set_font_mapping/global"_L1, "If true, applies globally; if false, applies only to the currently loaded PSD"_L1},
+
+            {"batch_call"_L1, "Run several tools in one request, in order. Useful for many cheap calls such as get_layer_details. Image tools are not available"_L1},
+            {"batch_call/calls"_L1, "JSON array of calls, each {\"tool\": name, \"args\": {parameter: value}} (e.g. [{\"tool\": \"get_layer_details\", \"args\": {\"layerId\": 12}}])"_L1},
+        };
+        return descriptions;
+    }
+
+private:
+    // Tool dispatch for batch_call: each entry unpacks a JSON args object
+    // straight into the typed parameters of the tool, with no QMetaMethod
+    // lookup or QVariant conversion per call.
+    using Dispatch = std::function<QString(McpServer *, const QJsonObject &)>;
+
+    template <typename T>
+    static T fromJsonArg(const QJsonValue &value)
+    {
+        if constexpr (std::is_same_v<T, int>)
+            return value.toInt();
+        else if constexpr (std::is_same_v<T, bool>)
+            return value.toBool();
+        // String parameters carrying JSON may also be given as objects or arrays
+        else if (value.isObject())
+            return QString::fromUtf8(QJsonDocument(value.toObject()).toJson(QJsonDocument::Compact));
+        else if (value.isArray())
+            return QString::fromUtf8(QJsonDocument(value.toArray()).toJson(QJsonDocument::Compact));
+        else
+            return value.toString();
+    }
+
+    template <typename... Args>
+    static Dispatch bindTool(QString (McpServer::*method)(Args...), std::array<QLatin1StringView, sizeof...(Args)> names)
+    {
+        return [method, names](McpServer *server, const QJsonObject &args) {
+            return [&]<size_t... I>(std::index_sequence<I...>) {
+                return (server->*method)(fromJsonArg<std::decay_t<Args>>(args[names[I]])...);
+            }(std::index_sequence_for<Args...>{});
+        };
+    }
+
+    static const QHash<QString, Dispatch> &dispatchTable()
+    {
+        static const QHash<QString, Dispatch> table = {
+            {u"get_server_stats"_s, bindTool(&McpServer::get_server_stats, {})},
+            {u"get_memory_usage"_s, bindTool(&McpServer::get_memory_usage, {"topN"_L1})},
+            {u"load_psd"_s, bindTool(&McpServer::load_psd, {"path"_L1})},
+            {u"get_layer_tree"_s, bindTool(&McpServer::get_layer_tree, {})},
+            {u"get_layer_tree_changes"_s, bindTool(&McpServer::get_layer_tree_changes, {"sinceGeneration"_L1})},
+            {u"get_layer_details"_s, bindTool(&McpServer::get_layer_details, {"layerId"_L1})},
+            {u"set_export_hint"_s, bindTool(&McpServer::set_export_hint, {"layerId"_L1, "type"_L1, "options"_L1})},
+            {u"suggest_hints"_s, bindTool(&McpServer::suggest_hints, {"layerId"_L1, "apply"_L1})},
+            {u"apply_hint_rules"_s, bindTool(&McpServer::apply_hint_rules, {"rules"_L1, "dryRun"_L1})},
+            {u"do_export"_s, bindTool(&McpServer::do_export, {"format"_L1, "outputDir"_L1, "options"_L1})},
+            {u"get_export_status"_s, bindTool(&McpServer::get_export_status, {"jobId"_L1})},
+            {u"list_exporters"_s, bindTool(&McpServer::list_exporters, {})},
+            {u"save_hints"_s, bindTool(&McpServer::save_hints, {})},
+            {u"recover_hints"_s, bindTool(&McpServer::recover_hints, {})},
+            {u"undo_hints"_s, bindTool(&McpServer::undo_hints, {"steps"_L1, "checkpoint"_L1})},
+            {u"redo_hints"_s, bindTool(&McpServer::redo_hints, {"steps"_L1, "checkpoint"_L1})},
+            {u"checkpoint_hints"_s, bindTool(&McpServer::checkpoint_hints, {"name"_L1})},
+            {u"get_contact_sheet_map"_s, bindTool(&McpServer::get_contact_sheet_map, {})},
+            {u"infer_layout"_s, bindTool(&McpServer::infer_layout, {"layerId"_L1, "options"_L1})},
+            {u"get_fonts_used"_s, bindTool(&McpServer::get_fonts_used, {})},
+            {u"get_font_mappings"_s, bindTool(&McpServer::get_font_mappings, {})},
+            {u"set_font_mapping"_s, bindTool(&McpServer::set_font_mapping, {"fromFont"_L1, "toFont"_L1, "global"_L1})},
+        };
+        return table;
+    }
+
+    QPsdGuiLayerTreeItemModel guiModel;
+    QPsdExporterTreeItemModel exporterModel;
+    QJsonObject lastContactSheet;
+    static constexpr int MaxSheetCells = 256;
+    static constexpr int MaxCellSize = 1024;
+    static constexpr qint64 MaxSheetPixels = 32 * 1000 * 1000;
+
+    // QPsdFontMapper is a process-wide singleton and not known to be
+    // thread-safe. Every call into it holds this, including whole plugin
+    // exports, which resolve fonts on the export thread. Kept apart from
+    // cacheMutex so that a long export blocks no cache.
+    static inline QMutex fontMutex;
+    // Context font mappings of the loaded PSD for the session file, so that
+    // writing it never waits for an export
+    QJsonObject contextFonts;
+
+    // Vector rasterizations of shape layers keyed by (layerId, scale * 1000).
+    // Rendering runs on worker threads (render_layers), hence the mutex.
+    mutable QMutex cacheMutex;
+    mutable QCache<QPair<qint32, int>, QImage> shapeCache{64 * 1024 * 1024};
+    // Flattened `merge` folders; stale entries age out as the generation moves on
+    mutable QCache<RasterCacheKey, QImage> mergedCache{128 * 1024 * 1024};
+    // Document generation, bumped on load and on every export hint change.
+    // `treeChanges` keeps the layers changed in each recent generation.
+    quint64 hintGeneration = 0;
+    quint64 loadGeneration = 0;
+    QMap<quint64, QList<qint32>> treeChanges;
+    QSet<qint32> pendingChanges;
+    static constexpr qsizetype TreeChangesKept = 1024;
+
+    // Hint edits of this session in order. Entries before `journalHead` are
+    // applied; undo moves the head back, and a new edit drops the entries
+    // after it. Edits made by one tool call share a batch number. Only the
+    // last HintJournalKept edits are kept.
+    struct HintEdit
+    {
+        qint32 layerId;
+        quint64 batch;
+        QPsdExporterTreeItemModel::ExportHint before;
+        QPsdExporterTreeItemModel::ExportHint after;
+    };
+    QList<HintEdit> hintJournal;
+    qsizetype journalHead = 0;
+    quint64 hintBatch = 0;
+    QHash<QString, qsizetype> hintCheckpoints;
+    static constexpr qsizetype HintJournalKept = 4096;
+    // Work is split by priority class: inspection tools run on the main
+    // thread, previews render on `renderPool`, and async exports run one at
+    // a time on `batchPool` at low thread priority, each on a copy of the
+    // document of its own.
+    QThreadPool renderPool;
+    QThreadPool batchPool;
+    struct ExportJob
+    {
+        QString format;
+        QString outputDir;
+        QFuture<QJsonObject> future;
+    };
+    QMap<int, ExportJob> exportJobs;
+    int lastExportJob = 0;
+    static constexpr qsizetype MaxPendingExports = 4;
+    static constexpr qsizetype FinishedExportsKept = 16;
+
+    // Timing of one tool call. phase() marks the end of a named step; when
+    // the trace goes out of scope the call is recorded by finishCall().
+    // Allocation counts are deltas of the process-wide counters, so they
+    // include the render pool's work for the call (and any background export).
+    struct CallTrace
+    {
+        struct Phase
+        {
+            const char *name;
+            qint64 nsecs;
+            AllocSnapshot allocs;
+        };
+        using Phases = QVarLengthArray<Phase, 8>;
+
+        CallTrace(McpServer *server, const char *tool)
+            : server(server), tool(tool), start(AllocSnapshot::now()), lastAllocs(start)
+        {
+            timer.start();
+        }
+        // `makeArgs` returns the arguments as a JSON object. Only the slow log
+        // writes them, so without one it is never called.
+        template <typename MakeArgs>
+        CallTrace(McpServer *server, const char *tool, MakeArgs &&makeArgs)
+            : server(server), tool(tool)
+            , args(server->slowLogFile.isEmpty() ? QJsonObject() : makeArgs())
+            , start(AllocSnapshot::now()), lastAllocs(start)
+        {
+            timer.start();
+        }
+        ~CallTrace() { server->finishCall(*this); }
+        Q_DISABLE_COPY_MOVE(CallTrace)
+
+        void phase(const char *name)
+        {
+            const auto now = timer.nsecsElapsed();
+            const auto allocs = AllocSnapshot::now();
+            phases.append({name, now - last, {allocs.count - lastAllocs.count, allocs.bytes - lastAllocs.bytes}});
+            last = now;
+            lastAllocs = allocs;
+        }
+
+        McpServer *server;
+        const char *tool;
+        QJsonObject args;
+        QElapsedTimer timer;
+        qint64 last = 0;
+        AllocSnapshot start;
+        AllocSnapshot lastAllocs;
+        Phases phases;
+    };
+
+    // The last calls, kept without their arguments
+    struct CallRecord
+    {
+        const char *tool = nullptr;
+        qint64 started = 0; // ms since server start
+        qint64 nsecs = 0;
+        AllocSnapshot allocs;
+        CallTrace::Phases phases;
+    };
+    // Allocations per tool over the server's lifetime
+    struct ToolAllocs
+    {
+        quint64 calls = 0;
+        quint64 count = 0;
+        quint64 bytes = 0;
+    };
+    QHash<QLatin1StringView, ToolAllocs> toolAllocs;
+    std::array<CallRecord, 256> callRing;
+    quint64 callCount = 0;
+    quint64 slowCalls = 0;
+    int slowThresholdMs = 0;
+    QString slowLogFile;
+    static constexpr qint64 SlowLogMaxBytes = 4 * 1024 * 1024;
+
+    // Masked leaf rasters in one shared memory segment per document (see
+    // setSharedCacheLimit()). `sharedPool` is attached on first use;
+    // `sharedRasters` holds the images this process keeps from it, up to
+    // the limit. The mutex also serializes this process's segment locking.
+    mutable QMutex sharedMutex;
+    mutable std::shared_ptr<QSharedMemory> sharedPool;
+    mutable bool sharedPoolFailed = false;
+    mutable QHash<qint32, QImage> sharedRasters;
+    mutable qint64 sharedRasterBytes = 0;
+    qint64 sharedCacheLimit = 0;
+
+    // Idle reclamation, see setIdleTimeouts()
+    enum IdleStage { IdleActive, IdleReleased, IdleEvicted };
+    QElapsedTimer uptime;
+    QElapsedTimer lastActivity;
+    QTimer idleTimer;
+    IdleStage idleStage = IdleActive;
+    int idleRelease = 0;
+    int idleEvict = 0;
+    // State restored by the next tool call, after an eviction or from the
+    // session file
+    QJsonObject pendingState;
+    QString restoreError;
+    // Size and modification time of the file when restoring it last failed
+    qint64 failedSize = -1;
+    QDateTime failedModified;
+    int cacheReleases = 0;
+    int evictions = 0;
+    int reloads = 0;
+    qint64 reclaimedCacheBytes = 0;
+    qint64 reclaimedDocumentBytes = 0;
+
+    // Session file; written shortly after each change and on exit
+    QString sessionFile;
+    QTimer sessionTimer;
+    // hintJournal as written to the session file; entries from
+    // `sessionJournalValid` on are stale
+    QJsonArray sessionJournal;
+    qsizetype sessionJournalValid = 0;
+    QByteArray documentHash;
+    qint64 documentSize = 0;
+    QDateTime documentModified;
+
+    // Layers whose hint changed since the last save_hints. With
+    // --hint-journal a crash log (.psd_journal) covers them until then;
+    // `journalRecords` counts its records and `journalPending` those found
+    // on load that recover_hints has not applied yet.
+    QSet<qint32> unsavedLayers;
+    bool hintJournalEnabled = false;
+    qsizetype journalRecords = 0;
+    qsizetype journalPending = 0;
+    static constexpr qsizetype JournalCompactRecords = 256;
+
+    // Smart object layers keyed by linked file name and pixel content. Layers
+    // placing the same asset share one canonical raster from the pool.
+    QHash<qint32, QByteArray> smartObjectKeys;
+    QHash<QByteArray, int> smartObjectRefs;
+    QHash<QByteArray, QImage> smartObjectPool;
+    // Scaled smart object renditions; keyed by content, so they survive reloads
+    mutable QCache<QPair<QByteArray, int>, QImage> smartObjectCache{64 * 1024 * 1024};
+    // RGB versions of CMYK layer rasters keyed by QImage::cacheKey(), so layers
+    // sharing pixel data are converted once
+    mutable QCache<qint64, QImage> colorCache{128 * 1024 * 1024};
+    // Shadow/glow rasters of leaf layers keyed by (layerId, 0, options)
+    mutable QCache<RasterCacheKey, QImage> effectCache{64 * 1024 * 1024};
+    // Fonts resolved through QPsdFontMapper for the loaded PSD, by original name
+    mutable QHash<QString, QFont> resolvedFonts;
+    // Shaped glyph runs per text run, keyed by fonts, text and layout width.
+    // Shared by all text layers, so repeated labels are shaped once.
+    mutable QCache<QString, QList<QList<QGlyphRun>>> glyphCache{16 * 1024 * 1024};
+    // Folder bounds by (layerId, withEffects)
+    mutable QHash<QPair<qint32, bool>, QRect> boundsCache;
+
+    // Per-document indexes, rebuilt on load. Names and font names are
+    // interned in `strings`, so the font index compares them by pointer.
+    StringPool strings;
+    // One entry per layer in tree order; `layerSlots` maps a layer id to its
+    // position in `layerTable`.
+    // Render workers read the entries, never the models: Qt item models make
+    // no thread-safety guarantee, even for reads.
+    struct LayerEntry
+    {
+        QPersistentModelIndex index;
+        QString name;
+        CompactHint hint;
+        const QPsdAbstractLayerItem *item = nullptr;
+        qint32 id = -1;
+        QList<qsizetype> children; // slots in row order
+        qsizetype parent = -1;
+        // Bumped when the hint of this layer or a descendant changes;
+        // keys the merged folder cache
+        quint64 generation = 0;
+    };
+    QList<LayerEntry> layerTable;
+    QHash<qint32, qsizetype> layerSlots;
+    QList<QString> fontNames;
+
+    QModelIndex findLayerById(qint32 id) const
+    {
+        const auto it = layerSlots.constFind(id);
+        return it == layerSlots.cend() ? QModelIndex() : QModelIndex(layerTable.at(*it).index);
+    }
+
+    // The hint of `index` as last set through setHint() or read on load.
+    // Main thread only; render workers read LayerEntry::hint.
+    const CompactHint &hintOf(const QModelIndex &index) const
+    {
+        static const CompactHint none;
+        const auto *layer = entryOf(index);
+        return layer ? layer->hint : none;
+    }
+
+    // Main thread only, like every use of the models
+    const LayerEntry *entryOf(const QModelIndex &index) const
+    {
+        const auto it = layerSlots.constFind(exporterModel.layerId(index));
+        return it == layerSlots.cend() ? nullptr : &layerTable.at(*it);
+    }
+
+    // Run an exporter plugin plus the optional SVG pass on `model`, which
+    // is either exporterModel or the private copy of a background job
+    static QJsonObject runExport(QPsdExporterTreeItemModel *model, QPsdExporterPlugin *plugin,
+                                 const QString &format, const QDir &outDir,
+                                 const QPsdExporterPlugin::ExportConfig &config, bool vectorShapes)
+    {
+        QJsonObject result{
+            {"format"_L1, format},
+            {"outputDir"_L1, outDir.path()},
+            {"width"_L1, config.targetSize.width()},
+            {"height"_L1, config.targetSize.height()},
+        };
+
+        // SVGs are extra assets: the exporter still writes these layers as
+        // usual, since no plugin can reference an SVG file yet
+        if (vectorShapes) {
+            QDir vectorDir(outDir.filePath("vectors"_L1));
+            if (!vectorDir.exists() && !vectorDir.mkpath("."_L1))
+                return QJsonObject{{"error"_L1, u"Cannot create directory: %1"_s.arg(vectorDir.path())}};
+            QJsonArray vectors;
+            QJsonArray rasterFallback;
+            QJsonArray vectorErrors;
+            exportVectorShapes(model, {}, vectorDir, vectors, rasterFallback, vectorErrors);
+            result["vectors"_L1] = vectors;
+            result["rasterFallback"_L1] = rasterFallback;
+            if (!vectorErrors.isEmpty())
+                result["vectorErrors"_L1] = vectorErrors;
+        }
+
+        // Plugins resolve fonts through QPsdFontMapper
+        QMutexLocker locker(&fontMutex);
+        if (!plugin->exportTo(model, outDir.path(), config))
+            return QJsonObject{{"error"_L1, "Export failed"_L1}};
+        return result;
+    }
+
+    // Set the hints of a freshly loaded copy of the document by layer id.
+    // Returns the number of layers found.
+    static qsizetype restoreHints(QPsdExporterTreeItemModel *model, const QModelIndex &parent,
+                                  const QHash<qint32, QPsdExporterTreeItemModel::ExportHint> &hints)
+    {
+        qsizetype found = 0;
+        for (int row = 0; row < model->rowCount(parent); ++row) {
+            const auto index = model->index(row, 0, parent);
+            if (const auto it = hints.constFind(model->layerId(index)); it != hints.cend()) {
+                model->setLayerHint(index, *it);
+                ++found;
+            }
+            found += restoreHints(model, index, hints);
+        }
+        return found;
+    }
+
+    // Plugin instances and font mappings are process-wide, so a synchronous
+    // export and set_font_mapping wait for background exports
+    QString exportBusy() const
+    {
+        for (auto it = exportJobs.cbegin(); it != exportJobs.cend(); ++it) {
+            if (!it->future.isFinished())
+                return toJson(QJsonObject{{"error"_L1, u"Export job %1 is still running; poll get_export_status"_s.arg(it.key())}});
+        }
+        return {};
+    }
+
+    // Keep only the most recent finished jobs around for get_export_status
+    void pruneExportJobs()
+    {
+        qsizetype finished = 0;
+        for (auto it = exportJobs.cbegin(); it != exportJobs.cend(); ++it)
+            finished += it->future.isFinished() ? 1 : 0;
+        for (auto it = exportJobs.begin(); it != exportJobs.end() && finished > FinishedExportsKept;) {
+            if (it->future.isFinished()) {
+                it = exportJobs.erase(it);
+                --finished;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // Drop everything derived from the loaded document
+    void resetDocument()
+    {
+        {
+            QMutexLocker locker(&cacheMutex);
+            shapeCache.clear();
+            mergedCache.clear();
+            colorCache.clear();
+            effectCache.clear();
+            resolvedFonts.clear();
+            boundsCache.clear();
+        }
+        ++hintGeneration;
+        loadGeneration = hintGeneration;
+        treeChanges.clear();
+        pendingChanges.clear();
+        smartObjectKeys.clear();
+        smartObjectRefs.clear();
+        smartObjectPool.clear();
+        layerTable.clear();
+        layerSlots.clear();
+        hintJournal.clear();
+        journalHead = 0;
+        hintCheckpoints.clear();
+        sessionJournal = {};
+        sessionJournalValid = 0;
+        unsavedLayers.clear();
+        journalRecords = 0;
+        journalPending = 0;
+        fontNames.clear();
+        strings.clear();
+        documentHash.clear();
+        contextFonts = {};
+        releaseSharedRasters();
+    }
+
+    // Detach from the shared segment once no image uses it; it goes away
+    // when no process maps it any more
+    qint64 releaseSharedRasters()
+    {
+        QMutexLocker locker(&sharedMutex);
+        sharedRasters.clear();
+        sharedPool.reset();
+        sharedPoolFailed = false;
+        return std::exchange(sharedRasterBytes, 0);
+    }
+
+    // Write a hint to the model and the layer table
+    void storeHint(const QModelIndex &index, const QPsdExporterTreeItemModel::ExportHint &hint)
+    {
+        exporterModel.setLayerHint(index, hint);
+        const auto it = layerSlots.constFind(exporterModel.layerId(index));
+        if (it == layerSlots.cend())
+            return;
+        layerTable[*it].hint = CompactHint::fromHint(exporterModel.layerHint(index), strings);
+        for (auto slot = *it; slot >= 0; slot = layerTable.at(slot).parent)
+            ++layerTable[slot].generation;
+    }
+
+    // Every tool-initiated hint write goes through here and is journaled.
+    // Call endHintBatch() once the tool has made all its edits.
+    void setHint(const QModelIndex &index, const QPsdExporterTreeItemModel::ExportHint &hint)
+    {
+        if (journalHead < hintJournal.size()) {
+            hintJournal.resize(journalHead);
+            sessionJournalValid = qMin(sessionJournalValid, journalHead);
+            hintCheckpoints.removeIf([this](decltype(hintCheckpoints)::iterator it) { return it.value() > journalHead; });
+        }
+        const auto layerId = exporterModel.layerId(index);
+        hintJournal.append({layerId, hintBatch, exporterModel.layerHint(index), hint});
+        journalHead = hintJournal.size();
+        unsavedLayers.insert(layerId);
+        pendingChanges.insert(layerId);
+        storeHint(index, hint);
+    }
+
+    void endHintBatch()
+    {
+        ++hintBatch;
+        logHints(pendingChanges);
+        trimHintJournal();
+        bumpGeneration();
+        scheduleSession();
+    }
+
+    // Bound the undo history; the oldest edits go first
+    void trimHintJournal()
+    {
+        const auto drop = hintJournal.size() - HintJournalKept;
+        if (drop <= 0)
+            return;
+        hintJournal.remove(0, drop);
+        journalHead = qMax(qsizetype(0), journalHead - drop);
+        for (auto it = hintCheckpoints.begin(); it != hintCheckpoints.end();) {
+            if (it.value() < drop) {
+                it = hintCheckpoints.erase(it);
+            } else {
+                it.value() -= drop;
+                ++it;
+            }
+        }
+        for (qsizetype i = 0; i < drop && !sessionJournal.isEmpty(); ++i)
+            sessionJournal.removeFirst();
+        sessionJournalValid = qMax(qsizetype(0), sessionJournalValid - drop);
+    }
+
+    // Start a new generation recording the layers changed since the last one
+    void bumpGeneration()
+    {
+        ++hintGeneration;
+        treeChanges.insert(hintGeneration, pendingChanges.values());
+        pendingChanges.clear();
+        while (treeChanges.size() > TreeChangesKept)
+            treeChanges.erase(treeChanges.begin());
+    }
+
+    // Undo or redo journal entries until the head is at `target`
+    QString moveJournalHead(qsizetype target)
+    {
+        QSet<qint32> changed;
+        qsizetype undone = 0;
+        qsizetype redone = 0;
+        for (; journalHead > target; --journalHead, ++undone) {
+            const auto &edit = hintJournal.at(journalHead - 1);
+            storeHint(findLayerById(edit.layerId), edit.before);
+            changed.insert(edit.layerId);
+        }
+        for (; journalHead < target; ++journalHead, ++redone) {
+            const auto &edit = hintJournal.at(journalHead);
+            storeHint(findLayerById(edit.layerId), edit.after);
+            changed.insert(edit.layerId);
+        }
+        unsavedLayers.unite(changed);
+        if (!changed.isEmpty()) {
+            logHints(changed);
+            pendingChanges.unite(changed);
+            bumpGeneration();
+            scheduleSession();
+        }
+
+        auto layerIds = changed.values();
+        std::sort(layerIds.begin(), layerIds.end());
+        QJsonArray ids;
+        for (const auto layerId : std::as_const(layerIds))
+            ids.append(layerId);
+        return toJson(QJsonObject{
+            {"undone"_L1, undone},
+            {"redone"_L1, redone},
+            {"layerIds"_L1, ids},
+            {"position"_L1, journalHead},
+            {"canUndo"_L1, journalHead > 0},
+            {"canRedo"_L1, journalHead < hintJournal.size()},
+        });
+    }
+
+    // Copy the loaded PSD's context font mappings; call with fontMutex held
+    void updateContextFonts()
+    {
+        contextFonts = {};
+        const auto contextMap = QPsdFontMapper::instance()->contextMappings(exporterModel.fileName());
+        for (auto it = contextMap.cbegin(); it != contextMap.cend(); ++it)
+            contextFonts[it.key()] = it.value();
+    }
+
+    // Error for tools that need a document; explains a failed reload
+    QString noDocument() const
+    {
+        return toJson(QJsonObject{{"error"_L1, restoreError.isEmpty() ? u"No PSD file loaded"_s : restoreError}});
+    }
+
+    QString journalPath() const
+    {
+        return exporterModel.fileName() + "_journal"_L1;
+    }
+
+    // Records of the crash log of edits made after the last save, oldest
+    // first. Records hold the complete hint, so the last one for a layer wins.
+    QList<QJsonObject> readHintJournal() const
+    {
+        QList<QJsonObject> records;
+        QFile file(journalPath());
+        if (!file.open(QIODevice::ReadOnly))
+            return records;
+        while (!file.atEnd()) {
+            const auto line = file.readLine().trimmed();
+            if (!line.isEmpty())
+                records.append(QJsonDocument::fromJson(line).object());
+        }
+        return records;
+    }
+
+    // Append the current hints of `layerIds` to the crash log. Past the
+    // threshold the log is rewritten with one record per unsaved layer,
+    // unless it still holds records not recovered yet.
+    void logHints(const QSet<qint32> &layerIds)
+    {
+        if (!hintJournalEnabled || layerIds.isEmpty())
+            return;
+        const bool rewrite = journalPending == 0 && journalRecords + layerIds.size() > JournalCompactRecords;
+        QFile file(journalPath());
+        if (!file.open(rewrite ? QIODevice::WriteOnly : QIODevice::Append)) {
+            qWarning("Cannot write %s: %s", qPrintable(file.fileName()), qPrintable(file.errorString()));
+            return;
+        }
+        if (rewrite)
+            journalRecords = 0;
+        auto ids = (rewrite ? unsavedLayers : layerIds).values();
+        std::sort(ids.begin(), ids.end());
+        QByteArray out;
+        for (const auto layerId : std::as_const(ids)) {
+            const auto index = findLayerById(layerId);
+            if (!index.isValid())
+                continue;
+            out += QJsonDocument(QJsonObject{
+                {"layerId"_L1, layerId},
+                {"hint"_L1, hintToJson(exporterModel.layerHint(index))},
+            }).toJson(QJsonDocument::Compact);
+            out += '\n';
+            ++journalRecords;
+        }
+        if (file.write(out) != out.size())
+            qWarning("Cannot write %s: %s", qPrintable(file.fileName()), qPrintable(file.errorString()));
+    }
+
+    // Hex SHA-256 of a file's content, as recorded in the session file
+    static QByteArray hashFile(const QString &path)
+    {
+        QFile file(path);
+        QCryptographicHash hash(QCryptographicHash::Sha256);
+        if (file.open(QIODevice::ReadOnly))
+            hash.addData(&file);
+        return hash.result().toHex();
+    }
+
+    // Parse and index a PSD for load_psd and session restore. A caller that
+    // already hashed the file passes `knownHash`; otherwise the file is
+    // hashed while QtPsd parses it. Phases are recorded on `trace` if given.
+    QJsonObject openDocument(const QString &path, const QByteArray &knownHash, CallTrace *trace)
+    {
+        resetDocument();
+
+        if (knownHash.isEmpty()) {
+            auto hash = QtConcurrent::run([path] { return hashFile(path); });
+            exporterModel.load(path);
+            documentHash = hash.result();
+        } else {
+            exporterModel.load(path);
+            documentHash = knownHash;
+        }
+        const QFileInfo info(path);
+        documentSize = info.size();
+        documentModified = info.lastModified();
+        if (trace)
+            trace->phase("parse");
+        scheduleSession();
+        scheduleIdle();
+        const auto err = exporterModel.errorMessage();
+        if (!err.isEmpty())
+            return QJsonObject{{"error"_L1, err}};
+
+        QSet<const void *> seenFonts;
+        indexLayers({}, -1, seenFonts);
+        {
+            QMutexLocker locker(&fontMutex);
+            updateContextFonts();
+        }
+        // Edits logged after the last save are only reported; reloading is
+        // how a bad batch of edits is dropped, so recover_hints is explicit
+        journalPending = readHintJournal().size();
+        journalRecords = journalPending;
+        if (trace)
+            trace->phase("index");
+
+        const auto potentialSavings = collectSmartObjects();
+        if (trace)
+            trace->phase("smart objects");
+
+        const auto sz = exporterModel.size();
+        QJsonObject result{
+            {"file"_L1, exporterModel.fileName()},
+            {"width"_L1, sz.width()},
+            {"height"_L1, sz.height()},
+            {"layerCount"_L1, layerTable.size()},
+            {"smartObjects"_L1, QJsonObject{
+                {"layers"_L1, smartObjectKeys.size()},
+                {"unique"_L1, smartObjectPool.size()},
+                {"potentialSavingsBytes"_L1, potentialSavings},
+            }},
+        };
+        if (journalPending > 0)
+            result["journalPending"_L1] = journalPending;
+        return result;
+    }
+
+    // Load the document described by a session state (see sessionState())
+    // and bring back its unsaved hints, journal and font context. Returns an
+    // error message on failure; nothing stays loaded then.
+    QString restoreState(const QJsonObject &session)
+    {
+        const auto path = session["path"_L1].toString();
+        if (session["version"_L1].toInt() != 1 || path.isEmpty())
+            return u"Unknown session state"_s;
+
+        // The size rules out most changes before parsing; the hash the rest
+        const auto changed = u"%1 changed on disk, so its unsaved hints and undo history were not applied. "
+                              "They are kept until load_psd is called; restore the file to get them back."_s.arg(path);
+        if (session.contains("size"_L1) && QFileInfo(path).size() != session["size"_L1].toInteger())
+            return changed;
+        const auto hash = hashFile(path);
+        if (hash != session["hash"_L1].toString().toLatin1())
+            return changed;
+        const auto loaded = openDocument(path, hash, nullptr);
+        if (loaded.contains("error"_L1)) {
+            unloadDocument();
+            return u"Cannot reload %1: %2"_s.arg(path, loaded["error"_L1].toString());
+        }
+
+        QHash<QString, QString> mappings;
+        const auto fonts = session["contextFonts"_L1].toObject();
+        for (auto it = fonts.constBegin(); it != fonts.constEnd(); ++it)
+            mappings.insert(it.key(), it.value().toString());
+        {
+            QMutexLocker locker(&fontMutex);
+            QPsdFontMapper::instance()->setContextMappings(path, mappings);
+            updateContextFonts();
+        }
+
+        // load_psd brought back the saved hints; apply the unsaved ones on top
+        const auto unsaved = session["unsaved"_L1].toArray();
+        for (const auto &value : unsaved) {
+            const auto record = value.toObject();
+            const auto layerId = record["layerId"_L1].toInt(-1);
+            const auto index = findLayerById(layerId);
+            if (!index.isValid())
+                continue;
+            storeHint(index, hintFromJson(record["hint"_L1].toObject()));
+            unsavedLayers.insert(layerId);
+            pendingChanges.insert(layerId);
+        }
+
+        const auto journal = session["journal"_L1].toArray();
+        sessionJournal = journal;
+        sessionJournalValid = journal.size();
+        for (const auto &value : journal) {
+            const auto record = value.toObject();
+            hintJournal.append({record["layerId"_L1].toInt(-1),
+                                quint64(record["batch"_L1].toInteger()),
+                                hintFromJson(record["before"_L1].toObject()),
+                                hintFromJson(record["after"_L1].toObject())});
+        }
+        journalHead = qBound(qsizetype(0), session["journalHead"_L1].toInteger(), hintJournal.size());
+        hintBatch = quint64(session["batch"_L1].toInteger());
+        const auto checkpoints = session["checkpoints"_L1].toObject();
+        for (auto it = checkpoints.constBegin(); it != checkpoints.constEnd(); ++it)
+            hintCheckpoints.insert(it.key(), qBound(qsizetype(0), it.value().toInteger(), hintJournal.size()));
+
+        if (!pendingChanges.isEmpty())
+            bumpGeneration();
+        return {};
+    }
+
+    void scheduleSession()
+    {
+        if (!sessionFile.isEmpty())
+            sessionTimer.start();
+    }
+
+    // Everything needed to bring the loaded document back in its current
+    // state; empty if nothing is loaded
+    QJsonObject sessionState()
+    {
+        if (exporterModel.fileName().isEmpty() || documentHash.isEmpty())
+            return {};
+
+        QJsonArray unsaved;
+        auto layerIds = unsavedLayers.values();
+        std::sort(layerIds.begin(), layerIds.end());
+        for (const auto layerId : std::as_const(layerIds)) {
+            const auto index = findLayerById(layerId);
+            if (index.isValid())
+                unsaved.append(QJsonObject{{"layerId"_L1, layerId}, {"hint"_L1, hintToJson(exporterModel.layerHint(index))}});
+        }
+
+        // Only the edits made since the last write are serialized
+        while (sessionJournal.size() > sessionJournalValid)
+            sessionJournal.removeLast();
+        for (auto i = sessionJournal.size(); i < hintJournal.size(); ++i) {
+            const auto &edit = hintJournal.at(i);
+            sessionJournal.append(QJsonObject{
+                {"layerId"_L1, edit.layerId},
+                {"batch"_L1, qint64(edit.batch)},
+                {"before"_L1, hintToJson(edit.before)},
+                {"after"_L1, hintToJson(edit.after)},
+            });
+        }
+        sessionJournalValid = hintJournal.size();
+
+        QJsonObject checkpoints;
+        for (auto it = hintCheckpoints.cbegin(); it != hintCheckpoints.cend(); ++it)
+            checkpoints[it.key()] = it.value();
+
+        return QJsonObject{
+            {"version"_L1, 1},
+            {"path"_L1, exporterModel.fileName()},
+            {"hash"_L1, QString::fromLatin1(documentHash)},
+            {"size"_L1, documentSize},
+            {"unsaved"_L1, unsaved},
+            {"journal"_L1, sessionJournal},
+            {"journalHead"_L1, journalHead},
+            {"batch"_L1, qint64(hintBatch)},
+            {"checkpoints"_L1, checkpoints},
+            {"contextFonts"_L1, contextFonts},
+        };
+    }
+
+    void finishCall(const CallTrace &trace)
+    {
+        const auto nsecs = trace.timer.nsecsElapsed();
+        const auto allocs = AllocSnapshot::now();
+        auto &record = callRing[callCount++ % callRing.size()];
+        record.tool = trace.tool;
+        record.started = uptime.elapsed() - nsecs / 1000000;
+        record.nsecs = nsecs;
+        record.allocs = {allocs.count - trace.start.count, allocs.bytes - trace.start.bytes};
+        record.phases = trace.phases;
+        if (!record.phases.isEmpty() && nsecs > trace.last) {
+            record.phases.append({"other", nsecs - trace.last,
+                                  {allocs.count - trace.lastAllocs.count, allocs.bytes - trace.lastAllocs.bytes}});
+        }
+#ifdef MCP_PSD2X_ALLOC_PROFILING
+        auto &perTool = toolAllocs[QLatin1StringView(trace.tool)];
+        ++perTool.calls;
+        perTool.count += record.allocs.count;
+        perTool.bytes += record.allocs.bytes;
+#endif
+
+        if (slowThresholdMs <= 0 || nsecs < qint64(slowThresholdMs) * 1000000)
+            return;
+        ++slowCalls;
+        if (slowLogFile.isEmpty())
+            return;
+
+        // The calls before this one often explain it (a cold cache, a reload)
+        QJsonArray previous;
+        for (quint64 n = qMin<quint64>(callCount - 1, 16); n > 0; --n)
+            previous.append(callRecordJson(callRing[(callCount - 1 - n) % callRing.size()]));
+        auto entry = callRecordJson(record);
+        entry["time"_L1] = QDateTime::currentDateTimeUtc().toString(Qt::ISODateWithMs);
+        entry["args"_L1] = trace.args;
+        entry["document"_L1] = QJsonObject{
+            {"file"_L1, exporterModel.fileName()},
+            {"layerCount"_L1, layerTable.size()},
+            {"generation"_L1, qint64(hintGeneration)},
+            {"journal"_L1, hintJournal.size()},
+            {"cacheBytes"_L1, cacheBytes()},
+        };
+        entry["previous"_L1] = previous;
+
+        // Keep one previous file once the log reaches its size limit
+        QDir().mkpath(QFileInfo(slowLogFile).absolutePath());
+        QFile file(slowLogFile);
+        if (file.size() >= SlowLogMaxBytes) {
+            const auto previousLog = slowLogFile + ".1"_L1;
+            QFile::remove(previousLog);
+            file.rename(previousLog);
+            file.setFileName(slowLogFile);
+        }
+        if (!file.open(QIODevice::Append)) {
+            qWarning("Cannot write slow log %s: %s", qPrintable(slowLogFile), qPrintable(file.errorString()));
+            return;
+        }
+        file.write(QJsonDocument(entry).toJson(QJsonDocument::Compact) + '\n');
+    }
+
+    static QJsonObject callRecordJson(const CallRecord &record)
+    {
+        QJsonArray phases;
+        for (const auto &phase : record.phases) {
+            QJsonObject obj{{"name"_L1, QLatin1StringView(phase.name)}, {"ms"_L1, phase.nsecs / 1e6}};
+#ifdef MCP_PSD2X_ALLOC_PROFILING
+            obj["allocs"_L1] = qint64(phase.allocs.count);
+            obj["allocBytes"_L1] = qint64(phase.allocs.bytes);
+#endif
+            phases.append(obj);
+        }
+        QJsonObject obj{
+            {"tool"_L1, QLatin1StringView(record.tool)},
+            {"started"_L1, record.started},
+            {"ms"_L1, record.nsecs / 1e6},
+            {"phases"_L1, phases},
+        };
+#ifdef MCP_PSD2X_ALLOC_PROFILING
+        obj["allocs"_L1] = qint64(record.allocs.count);
+        obj["allocBytes"_L1] = qint64(record.allocs.bytes);
+#endif
+        return obj;
+    }
+
+    // Allocation totals per tool and per internal phase; null unless built
+    // with MCP_PSD2X_ALLOC_PROFILING
+    QJsonValue allocationStats() const
+    {
+#ifdef MCP_PSD2X_ALLOC_PROFILING
+        QJsonObject perTool;
+        for (auto it = toolAllocs.cbegin(); it != toolAllocs.cend(); ++it) {
+            perTool[it.key()] = QJsonObject{
+                {"calls"_L1, qint64(it->calls)},
+                {"allocs"_L1, qint64(it->count)},
+                {"bytes"_L1, qint64(it->bytes)},
+            };
+        }
+        QJsonObject perPhase;
+        for (int i = 0; i < int(AllocPhase::Count); ++i) {
+            const auto phase = AllocSnapshot::forPhase(AllocPhase(i));
+            perPhase[QLatin1StringView(allocPhaseNames[i])] = QJsonObject{
+                {"allocs"_L1, qint64(phase.count)},
+                {"bytes"_L1, qint64(phase.bytes)},
+            };
+        }
+        const auto total = AllocSnapshot::now();
+        return QJsonObject{
+            {"allocs"_L1, qint64(total.count)},
+            {"bytes"_L1, qint64(total.bytes)},
+            {"perTool"_L1, perTool},
+            {"perPhase"_L1, perPhase},
+        };
+#else
+        return QJsonValue::Null;
+#endif
+    }
+
+    qint64 cacheBytes() const
+    {
+        QMutexLocker locker(&cacheMutex);
+        return shapeCache.totalCost() + mergedCache.totalCost() + smartObjectCache.totalCost()
+            + colorCache.totalCost() + effectCache.totalCost() + glyphCache.totalCost();
+    }
+
+    // Called at the start of every tool: restarts the idle countdown and
+    // reloads the document if it was evicted
+    void touch()
+    {
+        lastActivity.start();
+        idleStage = IdleActive;
+        if (!pendingState.isEmpty()) {
+            // A failed restore is only retried once the file has changed
+            const QFileInfo info(pendingState["path"_L1].toString());
+            const bool retry = restoreError.isEmpty() || info.size() != failedSize
+                || info.lastModified() != failedModified;
+            if (retry) {
+                const auto state = std::exchange(pendingState, {});
+                ++reloads;
+                restoreError = restoreState(state);
+                if (!restoreError.isEmpty()) {
+                    // Keep the state (and the session file) for a later attempt
+                    qWarning("%s", qPrintable(restoreError));
+                    pendingState = state;
+                    failedSize = info.size();
+                    failedModified = info.lastModified();
+                }
+            }
+        }
+        scheduleIdle();
+    }
+
+    void scheduleIdle()
+    {
+        qint64 due = 0;
+        if (idleStage == IdleActive && idleRelease > 0)
+            due = idleRelease;
+        else if (idleStage != IdleEvicted && idleEvict > 0 && !exporterModel.fileName().isEmpty())
+            due = idleEvict;
+        if (due <= 0) {
+            idleTimer.stop();
+            return;
+        }
+        const auto elapsed = lastActivity.isValid() ? lastActivity.elapsed() : 0;
+        idleTimer.start(int(qBound(qint64(0), due * 1000 - elapsed, qint64(std::numeric_limits<int>::max()))));
+    }
+
+    void idleTimeout()
+    {
+        if (idleStage == IdleActive && idleRelease > 0) {
+            releaseCaches();
+            idleStage = IdleReleased;
+        } else if (idleStage != IdleEvicted) {
+            releaseCaches();
+            evictDocument();
+            idleStage = IdleEvicted;
+        }
+        scheduleIdle();
+    }
+
+    void releaseCaches()
+    {
+        QMutexLocker locker(&cacheMutex);
+        const auto bytes = shapeCache.totalCost() + mergedCache.totalCost() + smartObjectCache.totalCost()
+            + colorCache.totalCost() + effectCache.totalCost() + glyphCache.totalCost();
+        shapeCache.clear();
+        mergedCache.clear();
+        smartObjectCache.clear();
+        colorCache.clear();
+        effectCache.clear();
+        glyphCache.clear();
+        resolvedFonts.clear();
+        boundsCache.clear();
+        lastContactSheet = {};
+        locker.unlock();
+        reclaimedCacheBytes += bytes + releaseSharedRasters();
+        ++cacheReleases;
+    }
+
+    // Unload the document, keeping what touch() needs to reload it
+    void evictDocument()
+    {
+        if (exporterModel.fileName().isEmpty())
+            return;
+        auto state = sessionState();
+        if (state.isEmpty())
+            return;
+
+        reclaimedDocumentBytes += unloadDocument();
+        pendingState = std::move(state);
+        ++evictions;
+    }
+
+    // Unload the document. Returns the bytes of layer rasters and masks that
+    // were actually freed, i.e. that nothing references any more.
+    qint64 unloadDocument()
+    {
+        QHash<qint64, QImage> images;
+        for (const auto &entry : std::as_const(layerTable)) {
+            const auto *item = exporterModel.layerItem(entry.index);
+            if (!item)
+                continue;
+            for (const auto &image : {item->image(), item->transparencyMask(), item->layerMask()}) {
+                if (!image.isNull())
+                    images.insert(image.cacheKey(), image);
+            }
+        }
+        resetDocument();
+        // Loading no file leaves the models empty
+        exporterModel.load(QString());
+
+        // Our copies are the last references to whatever the models released
+        qint64 freed = 0;
+        qsizetype kept = 0;
+        for (const auto &image : std::as_const(images)) {
+            if (image.isDetached())
+                freed += image.sizeInBytes();
+            else
+                ++kept;
+        }
+        if (kept > 0 || exporterModel.rowCount() > 0)
+            qWarning("Unloading the document left %lld layer images in memory", qint64(kept));
+        return freed;
+    }
+
+    // Build the layer table, the interned layer names and the font index
+    void indexLayers(const QModelIndex &parent, qsizetype parentSlot, QSet<const void *> &seenFonts)
+    {
+        const AllocScope scope(AllocPhase::TreeWalk);
+        for (int row = 0; row < exporterModel.rowCount(parent); ++row) {
+            auto index = exporterModel.index(row, 0, parent);
+            const auto layerId = exporterModel.layerId(index);
+            const auto *item = exporterModel.layerItem(index);
+            const auto slot = layerTable.size();
+            layerSlots.insert(layerId, slot);
+            layerTable.append({index, strings.intern(exporterModel.layerName(index)),
+                               CompactHint::fromHint(exporterModel.layerHint(index), strings), item, layerId, {},
+                               parentSlot});
+            if (parentSlot >= 0)
+                layerTable[parentSlot].children.append(slot);
+
+            if (item && item->type() == QPsdAbstractLayerItem::Text) {
+                const auto *text = static_cast<const QPsdTextLayerItem *>(item);
+                for (const auto &run : text->runs()) {
+                    if (run.originalFontName.isEmpty())
+                        continue;
+                    const auto fontName = strings.intern(run.originalFontName);
+                    if (!seenFonts.contains(StringPool::key(fontName))) {
+                        seenFonts.insert(StringPool::key(fontName));
+                        fontNames.append(fontName);
+                    }
+                }
+            }
+            indexLayers(index, slot, seenFonts);
+        }
+    }
+
+    // Serialize the layer tree under `parent` as a JSON array. Keys are
+    // written in the same (sorted) order QJsonObject would use.
+    void writeTree(const QModelIndex &parent, QByteArray &out) const
+    {
+        const AllocScope scope(AllocPhase::Serialization);
+        out += '[';
+        for (int row = 0; row < exporterModel.rowCount(parent); ++row) {
+            if (row > 0)
+                out += ',';
+            writeNode(exporterModel.index(row, 0, parent), out, true);
+        }
+        out += ']';
+    }
+
+    void writeNode(const QModelIndex &index, QByteArray &out, bool withChildren) const
+    {
+        const auto layerId = exporterModel.layerId(index);
+        out += '{';
+
+        if (withChildren && exporterModel.rowCount(index) > 0) {
+            out += "\"children\":";
+            writeTree(index, out);
+            out += ',';
+        }
+
+        const auto &entry = layerTable.at(layerSlots.value(layerId));
+        const auto &hint = entry.hint;
+        out += "\"hintType\":";
+        appendJsonString(out, hintTypeName(hint.type));
+        out += ",\"layerId\":";
+        out += QByteArray::number(layerId);
+        out += ",\"name\":";
+        out += strings.json(entry.name);
+        if (hint.hasProperties()) {
+            out += ",\"properties\":[";
+            bool first = true;
+            hint.forEachProperty([&out, &first](QStringView prop) {
+                if (!first)
+                    out += ',';
+                first = false;
+                appendJsonString(out, prop);
+            });
+            out += ']';
+        }
+
+        const auto *item = exporterModel.layerItem(index);
+        if (item) {
+            switch (item->type()) {
+            case QPsdAbstractLayerItem::Text:   out += ",\"type\":\"text\"";   break;
+            case QPsdAbstractLayerItem::Shape:  out += ",\"type\":\"shape\"";  break;
+            case QPsdAbstractLayerItem::Image:  out += ",\"type\":\"image\"";  break;
+            case QPsdAbstractLayerItem::Folder: out += ",\"type\":\"folder\""; break;
+            }
+        }
+
+        out += ",\"visible\":";
+        out += hint.visible ? "true" : "false";
+        out += '}';
+    }
+
+    // Register every placed (linked or embedded) asset in the smart object
+    // pool. Only layers sharing a linked file name and raster size can share
+    // pixels, so only those are hashed, in parallel on the render pool.
+    // Returns the raster bytes of layers duplicating a pooled asset. QtPsd
+    // gives each layer item its own copy, so these bytes are still held;
+    // they are what decoding each asset once could save.
+    qint64 collectSmartObjects()
+    {
+        const AllocScope scope(AllocPhase::TreeWalk);
+        QList<QPair<const LayerEntry *, QPair<QString, quint64>>> linked;
+        QHash<QPair<QString, quint64>, qsizetype> groupSizes;
+        for (const auto &entry : std::as_const(layerTable)) {
+            const auto *item = entry.item;
+            if (!item || item->type() != QPsdAbstractLayerItem::Image)
+                continue;
+            const auto name = item->linkedFile().name;
+            const QSize size = item->image().size();
+            if (name.isEmpty() || size.isEmpty())
+                continue;
+            const QPair<QString, quint64> group(name, (quint64(size.width()) << 32) | quint32(size.height()));
+            linked.append({&entry, group});
+            ++groupSizes[group];
+        }
+
+        QList<const QPsdAbstractLayerItem *> candidates;
+        for (const auto &[layer, group] : std::as_const(linked)) {
+            if (groupSizes.value(group) > 1)
+                candidates.append(layer->item);
+        }
+        const QList<QByteArray> hashes = QtConcurrent::blockingMapped(&renderPool, candidates,
+            [](const QPsdAbstractLayerItem *item) {
+                // Scanlines are hashed without their padding, which QImage
+                // leaves uninitialized
+                const QImage image = item->image();
+                const qsizetype lineBytes = (qsizetype(image.width()) * image.depth() + 7) / 8;
+                QCryptographicHash hash(QCryptographicHash::Sha1);
+                const int format = image.format();
+                hash.addData(QByteArrayView(reinterpret_cast<const char *>(&format), sizeof(format)));
+                for (int y = 0; y < image.height(); ++y)
+                    hash.addData(QByteArrayView(reinterpret_cast<const char *>(image.constScanLine(y)), lineBytes));
+                return hash.result();
+            });
+
+        // Keys outlive the document in smartObjectCache, so a key without a
+        // pixel hash carries the document's
+        qsizetype next = 0;
+        qint64 duplicateBytes = 0;
+        for (const auto &[layer, group] : std::as_const(linked)) {
+            const QImage image = layer->item->image();
+            QByteArray key = group.first.toUtf8() + '/' + QByteArray::number(group.second) + '/';
+            key += groupSizes.value(group) > 1 ? hashes.at(next++) : documentHash;
+            smartObjectKeys.insert(layer->id, key);
+            if (smartObjectPool.contains(key))
+                duplicateBytes += image.sizeInBytes();
+            else
+                smartObjectPool.insert(key, image);
+            ++smartObjectRefs[key];
+        }
+        return duplicateBytes;
+    }
+
+    static const QHash<QString, QPsdExporterTreeItemModel::ExportHint::Type> &hintTypes()
+    {
+        static const QHash<QString, QPsdExporterTreeItemModel::ExportHint::Type> typeMap = {
+            {"embed"_L1,  QPsdExporterTreeItemModel::ExportHint::Embed},
+            {"merge"_L1,  QPsdExporterTreeItemModel::ExportHint::Merged},
+            {"custom"_L1, QPsdExporterTreeItemModel::ExportHint::Component},
+            {"native"_L1, QPsdExporterTreeItemModel::ExportHint::Native},
+            {"skip"_L1,   QPsdExporterTreeItemModel::ExportHint::Skip},
+        };
+        return typeMap;
+    }
+
+    // Update `hint` from a set_export_hint type name and options object
+    static void applyHintOptions(QPsdExporterTreeItemModel::ExportHint &hint, const QString &type, const QJsonObject &opts)
+    {
+        hint.type = hintTypes().value(type);
+        if (opts.contains("id"_L1))
+            hint.id = opts["id"_L1].toString();
+        if (opts.contains("visible"_L1))
+            hint.visible = opts["visible"_L1].toBool();
+        if (opts.contains("componentName"_L1) && !opts["componentName"_L1].toString().isEmpty())
+            hint.componentName = opts["componentName"_L1].toString();
+        if (opts.contains("baseElement"_L1) && !opts["baseElement"_L1].toString().isEmpty())
+            hint.baseElement = QPsdExporterTreeItemModel::ExportHint::nativeName2Code(opts["baseElement"_L1].toString());
+        if (opts.contains("properties"_L1)) {
+            hint.properties.clear();
+            const auto propsArr = opts["properties"_L1].toArray();
+            for (const auto &val : propsArr)
+                hint.properties.insert(val.toString());
+        }
+    }
+
+    // Full hint as stored in the journal
+    static QJsonObject hintToJson(const QPsdExporterTreeItemModel::ExportHint &hint)
+    {
+        auto properties = hint.properties.values();
+        properties.sort();
+        return QJsonObject{
+            {"type"_L1, hintTypeName(hint.type)},
+            {"id"_L1, hint.id},
+            {"componentName"_L1, hint.componentName},
+            {"baseElement"_L1, QPsdExporterTreeItemModel::ExportHint::nativeCode2Name(hint.baseElement)},
+            {"visible"_L1, hint.visible},
+            {"properties"_L1, QJsonArray::fromStringList(properties)},
+        };
+    }
+
+    static QPsdExporterTreeItemModel::ExportHint hintFromJson(const QJsonObject &obj)
+    {
+        QPsdExporterTreeItemModel::ExportHint hint;
+        hint.type = hintTypes().value(obj["type"_L1].toString());
+        hint.id = obj["id"_L1].toString();
+        hint.componentName = obj["componentName"_L1].toString();
+        hint.baseElement = QPsdExporterTreeItemModel::ExportHint::nativeName2Code(obj["baseElement"_L1].toString());
+        hint.visible = obj["visible"_L1].toBool(true);
+        const auto propsArr = obj["properties"_L1].toArray();
+        for (const auto &val : propsArr)
+            hint.properties.insert(val.toString());
+        return hint;
+    }
+
+    // Split a layer name into words: "btn_Login Primary" -> btn, Login, Primary
+    static QStringList nameWords(const QString &name)
+    {
+        static const QRegularExpression separators(u"[^A-Za-z0-9]+|(?<=[a-z0-9])(?=[A-Z])"_s);
+        QStringList words = name.split(separators, Qt::SkipEmptyParts);
+        if (!words.isEmpty() && words.first().at(0).isDigit())
+            words.prepend(u"layer"_s);
+        return words;
+    }
+
+    static QString toCamelCase(const QString &name)
+    {
+        QString result;
+        const auto words = nameWords(name);
+        for (const auto &word : words) {
+            if (result.isEmpty())
+                result = word.toLower();
+            else
+                result += word.at(0).toUpper() + word.mid(1).toLower();
+        }
+        return result;
+    }
+
+    static QString toPascalCase(const QString &name)
+    {
+        QString result = toCamelCase(name);
+        if (!result.isEmpty())
+            result[0] = result.at(0).toUpper();
+        return result;
+    }
+
+    // 64-bit difference hash of a layer's appearance, for spotting repeated
+    // elements regardless of position
+    QPair<quint64, QSize> perceptualHash(const LayerEntry &layer) const
+    {
+        const QRect r = layer.item->type() == QPsdAbstractLayerItem::Folder
+            ? computeBoundingRect(layer, false) : layer.item->rect();
+        if (r.width() < 8 || r.height() < 8)
+            return {};
+
+        RenderOptions options;
+        options.scale = qMin(1.0, 64.0 / qMax(r.width(), r.height()));
+        const QImage image = renderLayer(layer, options);
+        if (image.isNull())
+            return {};
+
+        QImage small(9, 8, QImage::Format_RGB32);
+        small.fill(Qt::white);
+        {
+            QPainter painter(&small);
+            painter.setRenderHint(QPainter::SmoothPixmapTransform);
+            painter.drawImage(small.rect(), image);
+        }
+
+        quint64 hash = 0;
+        int minGray = 255;
+        int maxGray = 0;
+        for (int y = 0; y < 8; ++y) {
+            const QRgb *line = reinterpret_cast<const QRgb *>(small.constScanLine(y));
+            for (int x = 0; x < 8; ++x)
+                hash = (hash << 1) | (qGray(line[x]) > qGray(line[x + 1]) ? 1 : 0);
+            for (int x = 0; x < 9; ++x) {
+                minGray = qMin(minGray, qGray(line[x]));
+                maxGray = qMax(maxGray, qGray(line[x]));
+            }
+        }
+        // Uniform layers carry no shape to compare
+        if (maxGray - minGray <= 2)
+            return {};
+        return {hash, r.size()};
+    }
+
+    static QString hintTypeName(QPsdExporterTreeItemModel::ExportHint::Type t)
+    {
+        static const char *names[] = {"embed", "merge", "custom", "native", "skip"};
+        return QString::fromLatin1(names[t]);
+    }
+
+    // Convert a decoded layer raster to RGB for compositing. Print documents
+    // may carry CMYK rasters; those go through the per-profile LUT on first
+    // use and are cached.
+    QImage displayImage(const QImage &image) const
+    {
+        const AllocScope scope(AllocPhase::ImageConversion);
+#if QT_VERSION >= QT_VERSION_CHECK(6, 8, 0)
+        if (image.format() != QImage::Format_CMYK8888)
+            return image;
+
+        {
+            QMutexLocker locker(&cacheMutex);
+            if (const QImage *cached = colorCache.object(image.cacheKey()))
+                return *cached;
+        }
+        const QImage rgb = CmykLut::forColorSpace(image.colorSpace())->convert(image);
+        QMutexLocker locker(&cacheMutex);
+        colorCache.insert(image.cacheKey(), new QImage(rgb), rgb.sizeInBytes());
+        return rgb;
+#else
+        return image;
+#endif
+    }
+
+    static QSize scaledSize(const QSize &size, qreal scale)
+    {
+        return QSize(qCeil(size.width() * scale), qCeil(size.height() * scale));
+    }
+
+    // Render a single layer; folders are composited from their visible children
+    QImage renderLayer(const LayerEntry &layer, const RenderOptions &options = {}) const
+    {
+        const auto *item = layer.item;
+        if (!item)
+            return {};
+
+        const qreal scale = options.scale;
+        if (item->type() != QPsdAbstractLayerItem::Folder) {
+            const QImage image = leafImage(layer, options);
+            const QImage effects = renderEffects(layer, options);
+            if (effects.isNull())
+                return image;
+
+            // Draw the layer over its effects, which extend beyond its rect
+            const QRect painted = paintedRect(item);
+            const QRect area = painted.marginsAdded(effectMargins(item));
+            QImage canvas(effects.size(), QImage::Format_ARGB32_Premultiplied);
+            canvas.fill(Qt::transparent);
+            QPainter painter(&canvas);
+            painter.setRenderHint(QPainter::SmoothPixmapTransform);
+            painter.scale(scale, scale);
+            painter.drawImage(QRectF(QPointF(), area.size()), effects);
+            painter.drawImage(QRectF(painted.translated(-area.topLeft())), image);
+            painter.end();
+            return canvas;
+        }
+
+        const QRect bounds = computeBoundingRect(layer, true);
+        if (bounds.isEmpty())
+            return {};
+
+        return flattenFolder(layer, bounds, options);
+    }
+
+    // The raster of a layer, or the pooled one when it places a shared asset.
+    // Unmasked layers placing the same asset then composite from one image.
+    QImage layerRaster(const LayerEntry &layer) const
+    {
+        const auto soKey = smartObjectKeys.value(layer.id);
+        return soKey.isEmpty() ? layer.item->image() : smartObjectPool.value(soKey);
+    }
+
+    // Raster of a leaf layer, without masks or effects
+    QImage leafImage(const LayerEntry &layer, const RenderOptions &options) const
+    {
+        const auto *item = layer.item;
+        const qreal scale = options.scale;
+        if (options.mappedText && item->type() == QPsdAbstractLayerItem::Text)
+            return renderText(layer, scale);
+        if (item->type() == QPsdAbstractLayerItem::Shape) {
+            const QImage vector = rasterizeShape(layer, scale);
+            if (!vector.isNull())
+                return vector;
+        }
+        // Placed assets shared by several layers resolve to one canonical
+        // raster, so their scaled renditions are computed once
+        const auto soKey = smartObjectKeys.value(layer.id);
+        const QImage image = displayImage(soKey.isEmpty() ? item->image() : smartObjectPool.value(soKey));
+        if (image.isNull() || qFuzzyCompare(scale, 1.0))
+            return image;
+        if (soKey.isEmpty())
+            return image.scaled(scaledSize(image.size(), scale), Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+
+        const QPair<QByteArray, int> key(soKey, qRound(scale * 1000));
+        {
+            QMutexLocker locker(&cacheMutex);
+            if (const QImage *cached = smartObjectCache.object(key))
+                return *cached;
+        }
+        const QImage scaled = image.scaled(scaledSize(image.size(), scale), Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        QMutexLocker locker(&cacheMutex);
+        smartObjectCache.insert(key, new QImage(scaled), scaled.sizeInBytes());
+        return scaled;
+    }
+
+    // Extents of a layer's shadow and glow effects around its rect
+    static QMargins effectMargins(const QPsdAbstractLayerItem *item)
+    {
+        QMargins margins;
+        const auto grow = [&margins](int extent, const QPoint &offset) {
+            margins.setLeft(qMax(margins.left(), extent - offset.x()));
+            margins.setTop(qMax(margins.top(), extent - offset.y()));
+            margins.setRight(qMax(margins.right(), extent + offset.x()));
+            margins.setBottom(qMax(margins.bottom(), extent + offset.y()));
+        };
+        for (const QVariant &effect : item->effects()) {
+            if (effect.canConvert<QPsdShadowEffect>()) {
+                const auto shadow = effect.value<QPsdShadowEffect>();
+                if (shadow.type() == QPsdShadowEffect::DropShadow)
+                    grow(qCeil(shadow.blur()), shadowOffset(shadow).toPoint());
+            } else if (effect.canConvert<QPsdOuterGlowEffect>()) {
+                grow(qCeil(effect.value<QPsdOuterGlowEffect>().blur()), {});
+            }
+        }
+        return margins;
+    }
+
+    static QPointF shadowOffset(const QPsdShadowEffect &shadow)
+    {
+        // The angle is the direction of the light; the shadow falls opposite
+        const qreal angle = qDegreesToRadians(shadow.angle());
+        return QPointF(-qCos(angle), qSin(angle)) * shadow.distance();
+    }
+
+    // Separable running-sum box blur of an alpha plane; three passes
+    // approximate a Gaussian. The vertical pass sweeps whole rows with
+    // per-column accumulators so every inner loop is contiguous and
+    // vectorizes.
+    static void boxBlurAlpha(QImage &alpha, int radius)
+    {
+        const int w = alpha.width();
+        const int h = alpha.height();
+        if (radius <= 0 || w == 0 || h == 0)
+            return;
+        const int inverse = (1 << 16) / (radius * 2 + 1);
+
+        QImage tmp(w, h, QImage::Format_Alpha8);
+        QList<int> acc(w);
+        for (int pass = 0; pass < 3; ++pass) {
+            for (int y = 0; y < h; ++y) {
+                const uchar *src = alpha.constScanLine(y);
+                uchar *dst = tmp.scanLine(y);
+                int sum = 0;
+                for (int i = -radius; i <= radius; ++i)
+                    sum += src[qBound(0, i, w - 1)];
+                for (int x = 0; x < w; ++x) {
+                    dst[x] = uchar((sum * inverse) >> 16);
+                    sum += src[qMin(x + radius + 1, w - 1)] - src[qMax(x - radius, 0)];
+                }
+            }
+
+            std::fill(acc.begin(), acc.end(), 0);
+            for (int i = -radius; i <= radius; ++i) {
+                const uchar *src = tmp.constScanLine(qBound(0, i, h - 1));
+                for (int x = 0; x < w; ++x)
+                    acc[x] += src[x];
+            }
+            for (int y = 0; y < h; ++y) {
+                uchar *dst = alpha.scanLine(y);
+                for (int x = 0; x < w; ++x)
+                    dst[x] = uchar((acc[x] * inverse) >> 16);
+                const uchar *add = tmp.constScanLine(qMin(y + radius + 1, h - 1));
+                const uchar *sub = tmp.constScanLine(qMax(y - radius, 0));
+                for (int x = 0; x < w; ++x)
+                    acc[x] += add[x] - sub[x];
+            }
+        }
     }
 
-    Q_INVOKABLE QString save_hints()
+    // Draw the blurred, tinted silhouette of `source` with its top-left at `pos`
+    static void drawSilhouette(QPainter &painter, const QImage &source, const QPointF &pos,
+                               qreal blur, const QColor &color, qreal opacity)
     {
-        if (exporterModel.fileName().isEmpty())
-            return toJson(QJsonObject{{"error"_L1, "No PSD file loaded"_L1}});
+        const int pad = qCeil(blur);
+        QImage alpha(source.width() + pad * 2, source.height() + pad * 2, QImage::Format_Alpha8);
+        alpha.fill(0);
+        {
+            QPainter alphaPainter(&alpha);
+            alphaPainter.drawImage(pad, pad, source);
+        }
+        boxBlurAlpha(alpha, qRound(blur / 3));
+
+        QImage tinted(alpha.size(), QImage::Format_ARGB32_Premultiplied);
+        tinted.fill(color);
+        QPainter tintPainter(&tinted);
+        tintPainter.setCompositionMode(QPainter::CompositionMode_DestinationIn);
+        tintPainter.drawImage(0, 0, alpha);
+        tintPainter.end();
+
+        painter.save();
+        painter.setOpacity(painter.opacity() * opacity);
+        painter.drawImage(pos - QPointF(pad, pad), tinted);
+        painter.restore();
+    }
 
-        exporterModel.save();
-        return toJson(QJsonObject{{"saved"_L1, true}});
+    // Raster of a leaf layer as it is composited: masks applied, shape
+    // layers straight from their vector path when possible
+    QImage compositeImage(const LayerEntry &layer, const RenderOptions &options) const
+    {
+        const auto *item = layer.item;
+        QImage image;
+        if (options.mappedText && item->type() == QPsdAbstractLayerItem::Text)
+            image = renderText(layer, options.scale);
+        else if (item->type() == QPsdAbstractLayerItem::Shape)
+            image = rasterizeShape(layer, options.scale);
+        return image.isNull() ? maskedImage(layer) : image;
     }
 
-    Q_INVOKABLE QImage get_layer_image(int layerId)
+    // Drop shadows and outer glows of a leaf layer over paintedRect() grown
+    // by effectMargins(), cast by compositeImage(). Cached per (layerId, options).
+    // Effects are drawn with normal blending; their blend modes, spread and
+    // choke are not applied.
+    QImage renderEffects(const LayerEntry &layer, const RenderOptions &options) const
     {
-        auto index = findLayerById(layerId);
-        if (!index.isValid())
+        const auto *item = layer.item;
+        const auto effects = item->effects();
+        if (effects.isEmpty())
             return {};
 
-        const auto *item = exporterModel.layerItem(index);
-        if (!item)
+        const RasterCacheKey key(layer.id, 0, options);
+        {
+            QMutexLocker locker(&cacheMutex);
+            if (const QImage *cached = effectCache.object(key))
+                return *cached;
+        }
+        const QImage image = compositeImage(layer, options);
+        if (image.isNull())
             return {};
 
-        if (item->type() != QPsdAbstractLayerItem::Folder)
-            return item->image();
+        const qreal scale = options.scale;
+        const QRect layerRect = paintedRect(item);
+        const QRect area = layerRect.marginsAdded(effectMargins(item));
+        const QSize layerSize = scaledSize(layerRect.size(), scale);
+        const QImage source = image.size() == layerSize
+            ? image : image.scaled(layerSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        const QPointF layerPos = QPointF(layerRect.topLeft() - area.topLeft()) * scale;
 
-        // Folder layer: composite all visible children
-        const QRect bounds = computeBoundingRect(index);
-        if (bounds.isEmpty())
-            return {};
+        QImage canvas(scaledSize(area.size(), scale), QImage::Format_ARGB32_Premultiplied);
+        canvas.fill(Qt::transparent);
+        QPainter painter(&canvas);
+        for (const QVariant &effect : effects) {
+            if (effect.canConvert<QPsdShadowEffect>()) {
+                const auto shadow = effect.value<QPsdShadowEffect>();
+                if (shadow.type() != QPsdShadowEffect::DropShadow)
+                    continue;
+                drawSilhouette(painter, source, layerPos + shadowOffset(shadow) * scale,
+                               shadow.blur() * scale, QColor(shadow.color()), shadow.opacity());
+            } else if (effect.canConvert<QPsdOuterGlowEffect>()) {
+                const auto glow = effect.value<QPsdOuterGlowEffect>();
+                drawSilhouette(painter, source, layerPos,
+                               glow.blur() * scale, QColor(glow.color()), glow.opacity());
+            }
+        }
+        painter.end();
+
+        QMutexLocker locker(&cacheMutex);
+        effectCache.insert(key, new QImage(canvas), canvas.sizeInBytes());
+        return canvas;
+    }
+
+    // Composite the visible children of a folder in isolation.
+    // Folders hinted as `merge` are cached per (layerId, subtree generation,
+    // options), so a merged group is composited again only when a hint in
+    // its own subtree changes.
+    QImage flattenFolder(const LayerEntry &folder, const QRect &bounds, const RenderOptions &options) const
+    {
+        const AllocScope scope(AllocPhase::Compositing);
+        const bool merged = folder.hint.type == QPsdExporterTreeItemModel::ExportHint::Merged;
+        const RasterCacheKey key(folder.id, folder.generation, options);
+        const qreal scale = options.scale;
+        if (merged) {
+            QMutexLocker locker(&cacheMutex);
+            if (const QImage *cached = mergedCache.object(key))
+                return *cached;
+        }
 
-        QImage canvas(bounds.size(), QImage::Format_ARGB32);
+        QImage canvas(scaledSize(bounds.size(), scale), QImage::Format_ARGB32);
         canvas.fill(Qt::transparent);
 
         QPainter painter(&canvas);
-        const auto blendMode = item->record().blendMode();
+        painter.setRenderHint(QPainter::SmoothPixmapTransform);
+        painter.scale(scale, scale);
+        const auto blendMode = folder.item->record().blendMode();
         const bool passThrough = (blendMode == QPsdBlend::PassThrough);
-        compositeChildren(index, painter, bounds.topLeft(), passThrough);
+        compositeChildren(folder, painter, bounds.topLeft(), passThrough, options);
         painter.end();
 
+        if (merged) {
+            QMutexLocker locker(&cacheMutex);
+            mergedCache.insert(key, new QImage(canvas), canvas.sizeInBytes());
+        }
         return canvas;
     }
 
-    Q_INVOKABLE QString get_fonts_used()
+    // Outline of a shape layer in layer-local coordinates. QtPsd builds
+    // pathInfo() relative to the layer's rect(), as its shape items draw it.
+    static QPainterPath shapePath(const QPsdShapeLayerItem *shape)
     {
-        if (exporterModel.fileName().isEmpty())
-            return toJson(QJsonObject{{"error"_L1, "No PSD file loaded"_L1}});
-
-        QSet<QString> seen;
-        QJsonArray fonts;
-        collectFonts({}, seen, fonts);
-        return toJson(QJsonObject{{"fonts"_L1, fonts}});
+        const auto pi = shape->pathInfo();
+        QPainterPath path;
+        switch (pi.type) {
+        case QPsdAbstractLayerItem::PathInfo::None:
+            return path;
+        case QPsdAbstractLayerItem::PathInfo::Rectangle:
+            path.addRect(pi.rect);
+            break;
+        case QPsdAbstractLayerItem::PathInfo::RoundedRectangle:
+            path.addRoundedRect(pi.rect, pi.radius, pi.radius);
+            break;
+        case QPsdAbstractLayerItem::PathInfo::Path:
+            path = pi.path;
+            break;
+        }
+        return path;
     }
 
-    Q_INVOKABLE QString get_font_mappings()
+    // Serialize a shape layer as a standalone SVG document
+    static QByteArray shapeToSvg(const QPsdShapeLayerItem *shape)
     {
-        if (exporterModel.fileName().isEmpty())
-            return toJson(QJsonObject{{"error"_L1, "No PSD file loaded"_L1}});
-
-        auto *mapper = QPsdFontMapper::instance();
-
-        QJsonObject global;
-        const auto globalMap = mapper->globalMappings();
-        for (auto it = globalMap.cbegin(); it != globalMap.cend(); ++it)
-            global[it.key()] = it.value();
+        const QPainterPath path = shapePath(shape);
+        QByteArray d;
+        for (int i = 0; i < path.elementCount(); ++i) {
+            const auto e = path.elementAt(i);
+            switch (e.type) {
+            case QPainterPath::MoveToElement:
+                d += "M" + QByteArray::number(e.x, 'g', 6) + ' ' + QByteArray::number(e.y, 'g', 6);
+                break;
+            case QPainterPath::LineToElement:
+                d += "L" + QByteArray::number(e.x, 'g', 6) + ' ' + QByteArray::number(e.y, 'g', 6);
+                break;
+            case QPainterPath::CurveToElement: {
+                const auto c2 = path.elementAt(i + 1);
+                const auto end = path.elementAt(i + 2);
+                d += "C" + QByteArray::number(e.x, 'g', 6) + ' ' + QByteArray::number(e.y, 'g', 6)
+                    + ' ' + QByteArray::number(c2.x, 'g', 6) + ' ' + QByteArray::number(c2.y, 'g', 6)
+                    + ' ' + QByteArray::number(end.x, 'g', 6) + ' ' + QByteArray::number(end.y, 'g', 6);
+                i += 2;
+                break;
+            }
+            case QPainterPath::CurveToDataElement:
+                break;
+            }
+        }
 
-        QJsonObject context;
-        const auto contextMap = mapper->contextMappings(exporterModel.fileName());
-        for (auto it = contextMap.cbegin(); it != contextMap.cend(); ++it)
-            context[it.key()] = it.value();
+        const QColor fill = shape->brush().color();
+        const QPen pen = shape->pen();
+        const QRect r = shape->rect();
+        QByteArray svg = "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" + QByteArray::number(r.width())
+            + "\" height=\"" + QByteArray::number(r.height())
+            + "\" viewBox=\"0 0 " + QByteArray::number(r.width()) + ' ' + QByteArray::number(r.height()) + "\">\n"
+            + "  <path d=\"" + d + "\" fill-rule=\""
+            + (path.fillRule() == Qt::WindingFill ? "nonzero" : "evenodd") + "\" fill=\"" + fill.name().toLatin1() + '"';
+        if (fill.alpha() < 255)
+            svg += " fill-opacity=\"" + QByteArray::number(fill.alphaF(), 'g', 3) + '"';
+        if (pen.style() != Qt::NoPen && pen.widthF() > 0) {
+            svg += " stroke=\"" + pen.color().name().toLatin1() + "\" stroke-width=\""
+                + QByteArray::number(pen.widthF(), 'g', 4) + '"';
+        }
+        const qreal opacity = shape->opacity() * shape->fillOpacity();
+        if (opacity < 1.0)
+            svg += " opacity=\"" + QByteArray::number(opacity, 'g', 3) + '"';
+        svg += "/>\n</svg>\n";
+        return svg;
+    }
 
-        return toJson(QJsonObject{
-            {"global"_L1, global},
-            {"context"_L1, context},
-        });
+    // Write SVG files for the visible path shape layers under `dir`. Layers
+    // with effects, masks or non-solid fills, and layers whose file cannot
+    // be written, get no SVG.
+    static void exportVectorShapes(QPsdExporterTreeItemModel *model, const QModelIndex &parent, const QDir &dir,
+                                   QJsonArray &vectors, QJsonArray &rasterFallback, QJsonArray &errors)
+    {
+        for (int row = 0; row < model->rowCount(parent); ++row) {
+            const auto index = model->index(row, 0, parent);
+            const auto *item = model->layerItem(index);
+            const auto hint = model->layerHint(index);
+            if (!item || !item->isVisible() || !hint.visible
+                || hint.type == QPsdExporterTreeItemModel::ExportHint::Skip) {
+                continue;
+            }
+            if (item->type() == QPsdAbstractLayerItem::Shape) {
+                const auto *shape = static_cast<const QPsdShapeLayerItem *>(item);
+                if (shape->pathInfo().type == QPsdAbstractLayerItem::PathInfo::Path) {
+                    const auto layerId = model->layerId(index);
+                    if (!item->effects().isEmpty() || !item->layerMask().isNull()
+                        || shape->brush().style() != Qt::SolidPattern) {
+                        rasterFallback.append(layerId);
+                    } else {
+                        QString base = model->layerName(index).toLower();
+                        base.replace(QRegularExpression(u"[^a-z0-9]+"_s), u"_"_s);
+                        const auto fileName = u"%1_%2.svg"_s.arg(base).arg(layerId);
+                        QSaveFile file(dir.filePath(fileName));
+                        const auto svg = shapeToSvg(shape);
+                        if (!file.open(QIODevice::WriteOnly) || file.write(svg) != svg.size() || !file.commit()) {
+                            errors.append(QJsonObject{
+                                {"layerId"_L1, layerId},
+                                {"file"_L1, file.fileName()},
+                                {"error"_L1, file.errorString()},
+                            });
+                            rasterFallback.append(layerId);
+                        } else {
+                            const QRect r = item->rect();
+                            vectors.append(QJsonObject{
+                                {"layerId"_L1, layerId},
+                                {"file"_L1, file.fileName()},
+                                {"x"_L1, r.x()},
+                                {"y"_L1, r.y()},
+                                {"width"_L1, r.width()},
+                                {"height"_L1, r.height()},
+                            });
+                        }
+                    }
+                }
+            }
+            exportVectorShapes(model, index, dir, vectors, rasterFallback, errors);
+        }
     }
 
-    Q_INVOKABLE QString set_font_mapping(const QString &fromFont, const QString &toFont, bool global)
+    QFont resolvedFont(const QString &originalFontName) const
     {
-        if (exporterModel.fileName().isEmpty())
-            return toJson(QJsonObject{{"error"_L1, "No PSD file loaded"_L1}});
+        {
+            QMutexLocker locker(&cacheMutex);
+            const auto it = resolvedFonts.constFind(originalFontName);
+            if (it != resolvedFonts.cend())
+                return *it;
+        }
+        // Font matching can be slow; other renders keep using the caches meanwhile
+        QFont font;
+        {
+            QMutexLocker fontLocker(&fontMutex);
+            font = QPsdFontMapper::instance()->resolveFont(originalFontName, exporterModel.fileName());
+        }
+        QMutexLocker locker(&cacheMutex);
+        resolvedFonts.insert(originalFontName, font);
+        return font;
+    }
 
-        auto *mapper = QPsdFontMapper::instance();
+    // Lay out the runs of a text layer with the fonts QPsdFontMapper resolves
+    // for them, so that font substitutions can be previewed
+    QImage renderText(const LayerEntry &layer, qreal scale) const
+    {
+        const auto *text = static_cast<const QPsdTextLayerItem *>(layer.item);
+        const auto runs = text->runs();
+        const QRect rect = text->rect();
+        if (runs.isEmpty() || rect.isEmpty())
+            return {};
 
-        if (global) {
-            if (toFont.isEmpty())
-                mapper->removeGlobalMapping(fromFont);
-            else
-                mapper->setGlobalMapping(fromFont, toFont);
-            mapper->saveGlobalMappings();
-        } else {
-            auto mappings = mapper->contextMappings(exporterModel.fileName());
-            if (toFont.isEmpty())
-                mappings.remove(fromFont);
+        QString content;
+        QList<QTextLayout::FormatRange> formats;
+        QString key;
+        for (const auto &run : runs) {
+            QFont font = run.originalFontName.isEmpty() ? run.font : resolvedFont(run.originalFontName);
+            if (run.font.pixelSize() > 0)
+                font.setPixelSize(run.font.pixelSize());
             else
-                mappings[fromFont] = toFont;
-            mapper->setContextMappings(exporterModel.fileName(), mappings);
+                font.setPointSizeF(run.font.pointSizeF());
+
+            QTextLayout::FormatRange range;
+            range.start = content.size();
+            range.length = run.text.size();
+            range.format.setFont(font);
+            formats.append(range);
+            content += run.text;
+            // Colors are applied at draw time, so they stay out of the key
+            key += font.key() + QChar(0) + run.text + QChar(0);
+        }
+        // PSD text breaks lines with CR
+        content.replace(u'\r', QChar::LineSeparator);
+        content.replace(u'\n', QChar::LineSeparator);
+
+        const bool wrap = text->textType() == QPsdTextLayerItem::TextType::ParagraphText;
+        const Qt::Alignment alignment = runs.first().alignment & Qt::AlignHorizontal_Mask;
+        key += QString::number(wrap ? rect.width() : -1) + u'/' + QString::number(int(alignment));
+
+        QList<QList<QGlyphRun>> shaped;
+        {
+            QMutexLocker locker(&cacheMutex);
+            if (const auto *cached = glyphCache.object(key))
+                shaped = *cached;
+        }
+        if (shaped.isEmpty()) {
+            QTextLayout layout(content);
+            QTextOption option(alignment);
+            option.setWrapMode(wrap ? QTextOption::WrapAtWordBoundaryOrAnywhere : QTextOption::NoWrap);
+            layout.setTextOption(option);
+            layout.setFormats(formats);
+            layout.beginLayout();
+            qreal y = 0;
+            for (QTextLine line = layout.createLine(); line.isValid(); line = layout.createLine()) {
+                line.setLineWidth(rect.width());
+                line.setPosition(QPointF(0, y));
+                y += line.height();
+            }
+            layout.endLayout();
+
+            // Cost in bytes: each glyph keeps an index and a position
+            qint64 bytes = key.size() * qint64(sizeof(QChar));
+            for (const auto &range : formats) {
+                const auto glyphRuns = layout.glyphRuns(range.start, range.length);
+                for (const auto &run : glyphRuns)
+                    bytes += qint64(sizeof(QGlyphRun)) + run.glyphIndexes().size() * qint64(sizeof(quint32) + sizeof(QPointF));
+                shaped.append(glyphRuns);
+            }
+            QMutexLocker locker(&cacheMutex);
+            glyphCache.insert(key, new QList<QList<QGlyphRun>>(shaped), bytes);
         }
 
-        return toJson(QJsonObject{
-            {"fromFont"_L1, fromFont},
-            {"toFont"_L1, toFont},
-            {"global"_L1, global},
-        });
+        QImage image(scaledSize(rect.size(), scale), QImage::Format_ARGB32_Premultiplied);
+        image.fill(Qt::transparent);
+        QPainter painter(&image);
+        painter.setRenderHint(QPainter::Antialiasing);
+        painter.setRenderHint(QPainter::TextAntialiasing);
+        painter.scale(scale, scale);
+        for (int i = 0; i < runs.size() && i < shaped.size(); ++i) {
+            painter.setPen(runs.at(i).color);
+            for (const auto &glyphs : shaped.at(i))
+                painter.drawGlyphRun(QPointF(), glyphs);
+        }
+        painter.end();
+        return image;
     }
 
-    QHash<QString, QString> toolDescriptions() const override
+    // Whether a shape layer is drawn from its vector path rather than its
+    // stored raster (it has a path, a solid fill and no raster layer mask)
+    static bool isVectorShape(const QPsdShapeLayerItem *shape)
     {
-        return {
-            {"load_psd"_L1, "Load a PSD file for inspection and export"_L1},
-            {"load_psd/path"_L1, "Absolute path to the PSD file"_L1},
-
-            {"get_layer_tree"_L1, "Get the layer tree structure of the loaded PSD file"_L1},
+        return shape->pathInfo().type != QPsdAbstractLayerItem::PathInfo::None
+            && shape->brush().style() == Qt::SolidPattern && shape->layerMask().isNull();
+    }
 
-            {"get_layer_details"_L1, "Get detailed information about a specific layer"_L1},
-            {"get_layer_details/layerId"_L1, "Layer ID to inspect"_L1},
+    // How far a vector shape's stroke can reach past its layer rect. The
+    // stroke is centered on the path; miter joins and square caps reach
+    // further than half the pen width.
+    static QMargins strokeMargins(const QPsdShapeLayerItem *shape)
+    {
+        const QPen pen = shape->pen();
+        if (pen.style() == Qt::NoPen || pen.widthF() <= 0)
+            return {};
+        qreal extent = pen.widthF() / 2;
+        if (pen.joinStyle() == Qt::MiterJoin)
+            extent = qMax(extent, pen.widthF() * pen.miterLimit());
+        if (pen.capStyle() == Qt::SquareCap)
+            extent = qMax(extent, pen.widthF() / 2 * M_SQRT2);
+        const int pad = qCeil(extent);
+        return QMargins(pad, pad, pad, pad);
+    }
 
-            {"set_export_hint"_L1, "Configure how a layer should be exported"_L1},
-            {"set_export_hint/layerId"_L1, "Layer ID to configure"_L1},
-            {"set_export_hint/type"_L1, "Export type: embed, merge, custom, native, skip"_L1},
-            {"set_export_hint/options"_L1, "JSON object with optional keys: id (string, identifier for binding — empty string to clear), visible (bool), componentName (string, for custom type), baseElement (string: Container, TouchArea, Button, Button_Highlighted, for native type), properties (array of strings: visible, color, position, text, size, image — controls which attributes are exported as bindable properties)"_L1},
+    // Document rect covered by the image compositeImage() and leafImage()
+    // return: the layer rect, grown by the stroke of a vector shape
+    static QRect paintedRect(const QPsdAbstractLayerItem *item)
+    {
+        if (item->type() != QPsdAbstractLayerItem::Shape)
+            return item->rect();
+        const auto *shape = static_cast<const QPsdShapeLayerItem *>(item);
+        return isVectorShape(shape) ? shape->rect().marginsAdded(strokeMargins(shape)) : shape->rect();
+    }
 
-            {"do_export"_L1, "Export the loaded PSD to a target format and directory"_L1},
-            {"do_export/format"_L1, "Exporter plugin key (use list_exporters to see available ones)"_L1},
-            {"do_export/outputDir"_L1, "Absolute path to the output directory"_L1},
-            {"do_export/options"_L1, "JSON object with optional keys: width (int), height (int), fontScaleFactor (double), imageScaling (bool), makeCompact (bool). Width/height 0 or omitted = original size"_L1},
+    // Rasterize a shape layer from its vector description at `scale`, over
+    // paintedRect() so strokes are not clipped at the layer rect.
+    // Returns a null image when the stored raster has to be used instead
+    // (see isVectorShape()).
+    QImage rasterizeShape(const LayerEntry &layer, qreal scale) const
+    {
+        const auto *shape = static_cast<const QPsdShapeLayerItem *>(layer.item);
+        if (!isVectorShape(shape))
+            return {};
+        const QBrush brush = shape->brush();
 
-            {"list_exporters"_L1, "List all available exporter plugins"_L1},
+        const QPair<qint32, int> key(layer.id, qRound(scale * 1000));
+        {
+            QMutexLocker locker(&cacheMutex);
+            if (const QImage *cached = shapeCache.object(key))
+                return *cached;
+        }
 
-            {"save_hints"_L1, "Persist current export hints to the PSD sidecar file"_L1},
+        const QPainterPath path = shapePath(shape);
+        const QMargins pad = strokeMargins(shape);
+        const QRect area = shape->rect().marginsAdded(pad);
+        QImage image(scaledSize(area.size(), scale), QImage::Format_ARGB32_Premultiplied);
+        image.fill(Qt::transparent);
+        QPainter painter(&image);
+        painter.setRenderHint(QPainter::Antialiasing);
+        painter.scale(scale, scale);
+        painter.translate(pad.left(), pad.top());
+        painter.fillPath(path, brush);
+        const QPen pen = shape->pen();
+        if (pen.style() != Qt::NoPen && pen.widthF() > 0)
+            painter.strokePath(path, pen);
+        painter.end();
 
-            {"get_layer_image"_L1, "Get the rendered image of a specific layer"_L1},
-            {"get_layer_image/layerId"_L1, "Layer ID to get the image from"_L1},
+        QMutexLocker locker(&cacheMutex);
+        shapeCache.insert(key, new QImage(image), image.sizeInBytes());
+        return image;
+    }
 
-            {"get_fonts_used"_L1, "List all fonts used in the loaded PSD file with their resolved mappings"_L1},
+    // Recursively compute the bounding box of all child layers of `folder`.
+    // `withEffects` includes the extents of strokes, shadows and glows; it
+    // sizes preview canvases only, never the geometry tools report. Folder
+    // bounds only change on reload, so they are memoized per layer.
+    QRect computeBoundingRect(const LayerEntry &folder, bool withEffects) const
+    {
+        const QPair<qint32, bool> key(folder.id, withEffects);
+        {
+            QMutexLocker locker(&cacheMutex);
+            const auto it = boundsCache.constFind(key);
+            if (it != boundsCache.cend())
+                return *it;
+        }
 
-            {"get_font_mappings"_L1, "Get current font mapping settings (global and per-PSD context)"_L1},
+        QRect bounds;
+        for (const auto slot : folder.children) {
+            const auto &child = layerTable.at(slot);
+            const auto *item = child.item;
+            if (!item || !item->isVisible())
+                continue;
+            if (item->type() == QPsdAbstractLayerItem::Folder) {
+                bounds = bounds.united(computeBoundingRect(child, withEffects));
+            } else {
+                bounds = bounds.united(withEffects ? paintedRect(item).marginsAdded(effectMargins(item)) : item->rect());
+            }
+        }
 
-            {"set_font_mapping"_L1, "Set or remove a font mapping"_L1},
-            {"set_font_mapping/fromFont"_L1, "Original font name from PSD (e.g. MyriadPro-Bold)"_L1},
-            {"set_font_mapping/toFont"_L1, "Target font name to map to (empty string to remove mapping)"_L1},
-            {"set_font_mapping/global"_L1, "If true, applies globally; if false, applies only to the currently loaded PSD"_L1},
-        };
+        QMutexLocker locker(&cacheMutex);
+        boundsCache.insert(key, bounds);
+        return bounds;
     }
 
-private:
-    QPsdGuiLayerTreeItemModel guiModel;
-    QPsdExporterTreeItemModel exporterModel;
+    struct LayoutItem
+    {
+        qint32 id;
+        QRect rect;
+    };
 
-    QModelIndex findLayerById(qint32 id, const QModelIndex &parent = {}) const
+    // Edge of a rect along one axis: 0 = start, 1 = center, 2 = end
+    static int edge(const QRect &r, Qt::Orientation axis, int which)
     {
-        for (int row = 0; row < exporterModel.rowCount(parent); ++row) {
-            auto index = exporterModel.index(row, 0, parent);
-            if (exporterModel.layerId(index) == id)
-                return index;
-            auto found = findLayerById(id, index);
-            if (found.isValid())
-                return found;
-        }
-        return {};
+        const int start = axis == Qt::Horizontal ? r.left() : r.top();
+        const int size = axis == Qt::Horizontal ? r.width() : r.height();
+        return start + size * which / 2;
     }
 
-    int countLayers(const QModelIndex &parent) const
+    // Sweep along the cross axis and group items whose cross-axis extents
+    // overlap into bands; a band of two or more is a stack along `axis`
+    static QList<QList<LayoutItem>> sweepBands(QList<LayoutItem> items, Qt::Orientation axis)
     {
-        int count = 0;
-        for (int row = 0; row < exporterModel.rowCount(parent); ++row) {
-            count++;
-            count += countLayers(exporterModel.index(row, 0, parent));
+        const Qt::Orientation cross = axis == Qt::Horizontal ? Qt::Vertical : Qt::Horizontal;
+        std::sort(items.begin(), items.end(), [cross](const LayoutItem &a, const LayoutItem &b) {
+            return edge(a.rect, cross, 0) < edge(b.rect, cross, 0);
+        });
+
+        QList<QList<LayoutItem>> bands;
+        int bandEnd = std::numeric_limits<int>::min();
+        for (const auto &item : items) {
+            if (bands.isEmpty() || edge(item.rect, cross, 0) >= bandEnd) {
+                bands.append({});
+                bandEnd = std::numeric_limits<int>::min();
+            }
+            bands.last().append(item);
+            bandEnd = qMax(bandEnd, edge(item.rect, cross, 2));
         }
-        return count;
+        for (auto &band : bands) {
+            std::sort(band.begin(), band.end(), [axis](const LayoutItem &a, const LayoutItem &b) {
+                return edge(a.rect, axis, 0) < edge(b.rect, axis, 0);
+            });
+        }
+        return bands;
     }
 
-    void buildTree(const QModelIndex &parent, QJsonArray &array) const
+    // Describe a band as a stack: member ids, gaps and shared cross-axis alignment.
+    // Returns an empty object when members overlap along the stacking axis.
+    static QJsonObject describeStack(const QList<LayoutItem> &band, Qt::Orientation axis, int tolerance)
     {
-        for (int row = 0; row < exporterModel.rowCount(parent); ++row) {
-            auto index = exporterModel.index(row, 0, parent);
-            QJsonObject obj;
-            obj["layerId"_L1] = exporterModel.layerId(index);
-            obj["name"_L1] = exporterModel.layerName(index);
-            const auto *item = exporterModel.layerItem(index);
-            if (item) {
-                switch (item->type()) {
-                case QPsdAbstractLayerItem::Text:   obj["type"_L1] = "text"_L1;   break;
-                case QPsdAbstractLayerItem::Shape:  obj["type"_L1] = "shape"_L1;  break;
-                case QPsdAbstractLayerItem::Image:  obj["type"_L1] = "image"_L1;  break;
-                case QPsdAbstractLayerItem::Folder: obj["type"_L1] = "folder"_L1; break;
-                }
+        QJsonArray ids;
+        QList<int> gaps;
+        for (int i = 0; i < band.size(); ++i) {
+            ids.append(band.at(i).id);
+            if (i > 0) {
+                const int gap = edge(band.at(i).rect, axis, 0) - edge(band.at(i - 1).rect, axis, 2);
+                if (gap < -tolerance)
+                    return {};
+                gaps.append(gap);
             }
+        }
 
-            const auto hint = exporterModel.layerHint(index);
-            obj["hintType"_L1] = hintTypeName(hint.type);
-            obj["visible"_L1] = hint.visible;
-            if (!hint.properties.isEmpty()) {
-                QJsonArray propsArr;
-                for (const auto &prop : hint.properties)
-                    propsArr.append(prop);
-                obj["properties"_L1] = propsArr;
-            }
+        QJsonObject stack{{"layerIds"_L1, ids}};
+        const auto [minGap, maxGap] = std::minmax_element(gaps.cbegin(), gaps.cend());
+        if (*maxGap - *minGap <= tolerance) {
+            QList<int> sorted = gaps;
+            std::sort(sorted.begin(), sorted.end());
+            stack["spacing"_L1] = sorted.at(sorted.size() / 2);
+        } else {
+            QJsonArray gapsArr;
+            for (int gap : gaps)
+                gapsArr.append(gap);
+            stack["gaps"_L1] = gapsArr;
+        }
 
-            if (exporterModel.rowCount(index) > 0) {
-                QJsonArray children;
-                buildTree(index, children);
-                obj["children"_L1] = children;
+        const Qt::Orientation cross = axis == Qt::Horizontal ? Qt::Vertical : Qt::Horizontal;
+        static const char *names[2][3] = {{"left", "center", "right"}, {"top", "center", "bottom"}};
+        for (int which = 0; which < 3; ++which) {
+            int lo = std::numeric_limits<int>::max();
+            int hi = std::numeric_limits<int>::min();
+            for (const auto &item : band) {
+                lo = qMin(lo, edge(item.rect, cross, which));
+                hi = qMax(hi, edge(item.rect, cross, which));
+            }
+            if (hi - lo <= tolerance) {
+                stack["alignment"_L1] = QString::fromLatin1(names[cross == Qt::Horizontal ? 0 : 1][which]);
+                break;
             }
-
-            array.append(obj);
         }
+        return stack;
     }
 
-    void collectFonts(const QModelIndex &parent, QSet<QString> &seen, QJsonArray &fonts) const
+    // Cluster equal edges (within `tolerance`) into alignment guides
+    static void collectGuides(const QList<LayoutItem> &items, Qt::Orientation axis, int tolerance, QJsonArray &guides)
     {
-        const auto psdPath = exporterModel.fileName();
-        for (int row = 0; row < exporterModel.rowCount(parent); ++row) {
-            auto index = exporterModel.index(row, 0, parent);
-            const auto *item = exporterModel.layerItem(index);
-            if (item && item->type() == QPsdAbstractLayerItem::Text) {
-                const auto *text = static_cast<const QPsdTextLayerItem *>(item);
-                for (const auto &run : text->runs()) {
-                    if (!run.originalFontName.isEmpty() && !seen.contains(run.originalFontName)) {
-                        seen.insert(run.originalFontName);
-                        const auto resolved = QPsdFontMapper::instance()->resolveFont(run.originalFontName, psdPath);
-                        fonts.append(QJsonObject{
-                            {"psdFont"_L1, run.originalFontName},
-                            {"resolvedFont"_L1, resolved.family()},
-                            {"resolvedStyle"_L1, resolved.styleName()},
-                        });
-                    }
+        static const char *names[2][3] = {{"left", "centerX", "right"}, {"top", "centerY", "bottom"}};
+        for (int which = 0; which < 3; ++which) {
+            QList<QPair<int, qint32>> edges;
+            edges.reserve(items.size());
+            for (const auto &item : items)
+                edges.append({edge(item.rect, axis, which), item.id});
+            std::sort(edges.begin(), edges.end());
+
+            for (qsizetype i = 0; i < edges.size();) {
+                qsizetype j = i + 1;
+                while (j < edges.size() && edges.at(j).first - edges.at(j - 1).first <= tolerance)
+                    ++j;
+                if (j - i >= 2) {
+                    QJsonArray ids;
+                    for (qsizetype k = i; k < j; ++k)
+                        ids.append(edges.at(k).second);
+                    guides.append(QJsonObject{
+                        {"edge"_L1, QString::fromLatin1(names[axis == Qt::Horizontal ? 0 : 1][which])},
+                        {"position"_L1, edges.at(i).first},
+                        {"layerIds"_L1, ids},
+                    });
                 }
+                i = j;
             }
-            collectFonts(index, seen, fonts);
         }
     }
 
-    static QString hintTypeName(QPsdExporterTreeItemModel::ExportHint::Type t)
+    // Masked raster of a leaf layer, through the cross-process cache when
+    // it is enabled
+    QImage maskedImage(const LayerEntry &layer) const
     {
-        static const char *names[] = {"embed", "merge", "custom", "native", "skip"};
-        return QString::fromLatin1(names[t]);
+        if (sharedCacheLimit <= 0 || documentHash.isEmpty())
+            return applyMasks(layer);
+
+        {
+            QMutexLocker locker(&sharedMutex);
+            if (const auto it = sharedRasters.constFind(layer.id); it != sharedRasters.cend())
+                return *it;
+        }
+        const auto pool = sharedRasterPool();
+        if (!pool)
+            return applyMasks(layer);
+        QImage image = findSharedRaster(pool, layer.id);
+        if (image.isNull()) {
+            const QImage local = applyMasks(layer);
+            image = publishSharedRaster(pool, layer.id, local);
+            if (image.isNull())
+                return local;
+        }
+
+        // Kept up to this process's budget; others are used once
+        QMutexLocker locker(&sharedMutex);
+        if (const auto it = sharedRasters.constFind(layer.id); it != sharedRasters.cend())
+            return *it;
+        if (sharedRasterBytes + image.sizeInBytes() <= sharedCacheLimit) {
+            sharedRasters.insert(layer.id, image);
+            sharedRasterBytes += image.sizeInBytes();
+        }
+        return image;
     }
 
-    // Recursively compute the bounding box of all child layers under `parent`
-    QRect computeBoundingRect(const QModelIndex &parent) const
+    // Segment layout: a header, a table of rasters keyed by layer id (open
+    // addressing), then the pixel area, handed out front to back. `magic`
+    // is written last, so a segment still being set up is not used. The
+    // segment is locked around table access only, never around pixel copies.
+    struct SharedPoolHeader
     {
-        QRect bounds;
-        for (int row = 0; row < exporterModel.rowCount(parent); ++row) {
-            auto index = exporterModel.index(row, 0, parent);
-            const auto *item = exporterModel.layerItem(index);
-            if (!item || !item->isVisible())
-                continue;
-            if (item->type() == QPsdAbstractLayerItem::Folder) {
-                bounds = bounds.united(computeBoundingRect(index));
-            } else {
-                bounds = bounds.united(item->rect());
+        quint32 magic;
+        quint32 slots;
+        qint64 capacity; // bytes in the pixel area
+        qint64 used;     // bytes handed out from its start
+    };
+    struct SharedRasterEntry
+    {
+        qint32 layerId;
+        quint32 state;
+        qint32 width;
+        qint32 height;
+        qint32 format;
+        qint32 reserved;
+        qint64 bytesPerLine;
+        qint64 offset; // into the pixel area
+    };
+    enum SharedRasterState : quint32 { SlotEmpty, SlotWriting, SlotReady };
+    static constexpr quint32 SharedPoolMagic = 0x50534450; // "PSDP"
+    static constexpr quint32 SharedPoolSlots = 4096;
+    static constexpr qsizetype SharedPoolHeaderSize = 64;
+
+    static qint64 sharedTableSize(quint32 slots)
+    {
+        return qint64(slots) * qint64(sizeof(SharedRasterEntry));
+    }
+
+    // The header of a locked segment, or nullptr when it does not describe
+    // a table and pixel area within the segment's size
+    static SharedPoolHeader *sharedPoolHeader(QSharedMemory *memory)
+    {
+        if (memory->size() < SharedPoolHeaderSize)
+            return nullptr;
+        auto *header = static_cast<SharedPoolHeader *>(memory->data());
+        if (header->magic != SharedPoolMagic || header->slots == 0 || header->slots > SharedPoolSlots
+            || header->capacity < 0 || header->used < 0 || header->used > header->capacity
+            || header->capacity > memory->size() - SharedPoolHeaderSize - sharedTableSize(header->slots)) {
+            return nullptr;
+        }
+        return header;
+    }
+
+    static SharedRasterEntry *sharedTable(QSharedMemory *memory)
+    {
+        return reinterpret_cast<SharedRasterEntry *>(static_cast<char *>(memory->data()) + SharedPoolHeaderSize);
+    }
+
+    // Slot holding `layerId`, or the empty slot where it would go; -1 when
+    // the table is full
+    static qint64 findSharedSlot(const SharedPoolHeader *header, const SharedRasterEntry *table, qint32 layerId)
+    {
+        const quint32 start = (quint32(layerId) * 2654435761u) % header->slots;
+        for (quint32 i = 0; i < header->slots; ++i) {
+            const quint32 slot = (start + i) % header->slots;
+            if (table[slot].state == SlotEmpty || table[slot].layerId == layerId)
+                return slot;
+        }
+        return -1;
+    }
+
+    // Attach to the document's segment, or create it with room for
+    // sharedCacheLimit bytes of rasters. One segment per document keeps the
+    // number of segments (and SysV keys) independent of the layer count.
+    std::shared_ptr<QSharedMemory> sharedRasterPool() const
+    {
+        QMutexLocker locker(&sharedMutex);
+        if (sharedPool || sharedPoolFailed)
+            return sharedPool;
+
+        auto memory = std::make_shared<QSharedMemory>();
+        memory->setKey(u"mcp-psd2x-%1"_s.arg(QLatin1StringView(documentHash.left(32))));
+        const qint64 tableEnd = SharedPoolHeaderSize + sharedTableSize(SharedPoolSlots);
+        if (memory->create(tableEnd + sharedCacheLimit)) {
+            memory->lock();
+            auto *data = static_cast<char *>(memory->data());
+            std::memset(data, 0, tableEnd);
+            SharedPoolHeader header{0, SharedPoolSlots, sharedCacheLimit, 0};
+            std::memcpy(data, &header, sizeof(header));
+            static_cast<SharedPoolHeader *>(memory->data())->magic = SharedPoolMagic;
+            memory->unlock();
+        } else if (memory->error() != QSharedMemory::AlreadyExists || !memory->attach()) {
+            qWarning("Cannot use the shared raster cache: %s", qPrintable(memory->errorString()));
+            sharedPoolFailed = true;
+            return {};
+        }
+        sharedPool = memory;
+        return sharedPool;
+    }
+
+    // Map a raster another process (or this one) published. The image keeps
+    // the segment attached for as long as it lives. Entries that do not
+    // describe a valid image within the pixel area are ignored.
+    QImage findSharedRaster(const std::shared_ptr<QSharedMemory> &pool, qint32 layerId) const
+    {
+        SharedRasterEntry entry{};
+        quint32 slots = 0;
+        qint64 capacity = 0;
+        {
+            QMutexLocker locker(&sharedMutex);
+            pool->lock();
+            if (const auto *header = sharedPoolHeader(pool.get())) {
+                const auto *table = sharedTable(pool.get());
+                const auto slot = findSharedSlot(header, table, layerId);
+                if (slot >= 0 && table[slot].state == SlotReady && table[slot].layerId == layerId) {
+                    entry = table[slot];
+                    slots = header->slots;
+                    capacity = header->capacity;
+                }
             }
+            pool->unlock();
         }
-        return bounds;
+        if (entry.state != SlotReady || entry.width <= 0 || entry.height <= 0
+            || entry.format <= QImage::Format_Invalid || entry.format >= QImage::NImageFormats
+            || entry.bytesPerLine <= 0 || entry.bytesPerLine % 4 != 0
+            || entry.offset < 0 || entry.offset > capacity) {
+            return {};
+        }
+        const auto bitsPerPixel = QImage::toPixelFormat(QImage::Format(entry.format)).bitsPerPixel();
+        if ((qint64(entry.width) * bitsPerPixel + 7) / 8 > entry.bytesPerLine
+            || entry.bytesPerLine > (capacity - entry.offset) / entry.height) {
+            return {};
+        }
+        const auto *pixels = static_cast<const uchar *>(pool->constData()) + SharedPoolHeaderSize
+            + sharedTableSize(slots) + entry.offset;
+        return QImage(pixels, entry.width, entry.height, entry.bytesPerLine, QImage::Format(entry.format),
+                      [](void *info) { delete static_cast<std::shared_ptr<QSharedMemory> *>(info); },
+                      new std::shared_ptr<QSharedMemory>(pool));
+    }
+
+    // Copy `image` into the pool and return it backed by the segment, or a
+    // null image when the pool is full or another process is publishing the
+    // same layer. The slot and its bytes are reserved in one step, so
+    // concurrent publishers cannot overshoot the pool.
+    QImage publishSharedRaster(const std::shared_ptr<QSharedMemory> &pool, qint32 layerId, const QImage &image) const
+    {
+        if (image.isNull())
+            return {};
+        const qint64 bytes = image.sizeInBytes();
+        const qint64 reserved = (bytes + 63) & ~qint64(63);
+
+        SharedRasterEntry *entry = nullptr;
+        uchar *pixels = nullptr;
+        {
+            QMutexLocker locker(&sharedMutex);
+            pool->lock();
+            if (auto *header = sharedPoolHeader(pool.get()); header && header->capacity - header->used >= reserved) {
+                auto *table = sharedTable(pool.get());
+                const auto slot = findSharedSlot(header, table, layerId);
+                if (slot >= 0 && table[slot].state == SlotEmpty) {
+                    entry = &table[slot];
+                    *entry = {layerId, SlotWriting, image.width(), image.height(), int(image.format()), 0,
+                              image.bytesPerLine(), header->used};
+                    pixels = static_cast<uchar *>(pool->data()) + SharedPoolHeaderSize
+                        + sharedTableSize(header->slots) + header->used;
+                    header->used += reserved;
+                }
+            }
+            pool->unlock();
+        }
+        if (!entry)
+            return {};
+
+        std::memcpy(pixels, image.constBits(), bytes);
+        {
+            QMutexLocker locker(&sharedMutex);
+            pool->lock();
+            entry->state = SlotReady;
+            pool->unlock();
+        }
+        return QImage(pixels, image.width(), image.height(), image.bytesPerLine(), image.format(),
+                      [](void *info) { delete static_cast<std::shared_ptr<QSharedMemory> *>(info); },
+                      new std::shared_ptr<QSharedMemory>(pool));
     }
 
     // Apply transparency mask and layer mask to a layer's image
-    QImage applyMasks(const QPsdAbstractLayerItem *item) const
+    QImage applyMasks(const LayerEntry &layer) const
     {
-        QImage image = item->image();
+        const AllocScope scope(AllocPhase::Masking);
+        const auto *item = layer.item;
+        QImage image = displayImage(layerRaster(layer));
         if (image.isNull())
             return image;
 
@@ -720,14 +4639,15 @@ private:
     // Recursively composite visible children onto the given painter.
     // `origin` is the top-left of the canvas in document coordinates.
     // `passThrough` means children are drawn directly (no intermediate buffer).
-    void compositeChildren(const QModelIndex &parent, QPainter &painter,
-                           const QPoint &origin, bool passThrough) const
+    // The painter is expected to be scaled by `options.scale` already.
+    void compositeChildren(const LayerEntry &parent, QPainter &painter,
+                           const QPoint &origin, bool passThrough, const RenderOptions &options) const
     {
-        const int count = exporterModel.rowCount(parent);
+        const AllocScope scope(AllocPhase::Compositing);
         // Iterate bottom-to-top (last row = bottommost layer in PSD model)
-        for (int row = count - 1; row >= 0; --row) {
-            auto index = exporterModel.index(row, 0, parent);
-            const auto *item = exporterModel.layerItem(index);
+        for (auto it = parent.children.crbegin(); it != parent.children.crend(); ++it) {
+            const auto &layer = layerTable.at(*it);
+            const auto *item = layer.item;
             if (!item || !item->isVisible())
                 continue;
 
@@ -735,40 +4655,51 @@ private:
                 const auto folderBlend = item->record().blendMode();
                 const bool folderPassThrough = (folderBlend == QPsdBlend::PassThrough);
 
-                if (folderPassThrough) {
+                // Merged folders are flattened like the exporter does, even when
+                // they are PassThrough, so that their cached raster can be reused
+                const bool merged = layer.hint.type == QPsdExporterTreeItemModel::ExportHint::Merged;
+
+                if (folderPassThrough && !merged) {
                     // PassThrough: children draw directly onto the current canvas
-                    compositeChildren(index, painter, origin, true);
+                    compositeChildren(layer, painter, origin, true, options);
                 } else {
                     // Non-PassThrough: composite children into an intermediate buffer
-                    const QRect childBounds = computeBoundingRect(index);
+                    const QRect childBounds = computeBoundingRect(layer, true);
                     if (childBounds.isEmpty())
                         continue;
 
-                    QImage groupCanvas(childBounds.size(), QImage::Format_ARGB32);
-                    groupCanvas.fill(Qt::transparent);
-
-                    QPainter groupPainter(&groupCanvas);
-                    compositeChildren(index, groupPainter, childBounds.topLeft(), false);
-                    groupPainter.end();
+                    const QImage groupCanvas = flattenFolder(layer, childBounds, options);
 
                     // Draw the group buffer with the folder's blend mode and opacity
                     painter.save();
-                    painter.setCompositionMode(QtPsdGui::compositionMode(folderBlend));
+                    painter.setCompositionMode(folderPassThrough
+                        ? QPainter::CompositionMode_SourceOver
+                        : QtPsdGui::compositionMode(folderBlend));
                     painter.setOpacity(painter.opacity() * item->opacity() * item->fillOpacity());
-                    painter.drawImage(childBounds.topLeft() - origin, groupCanvas);
+                    painter.drawImage(QRectF(childBounds.translated(-origin)), groupCanvas);
                     painter.restore();
                 }
             } else {
                 // Leaf layer: apply masks, then draw with blend mode and opacity
-                QImage layerImage = applyMasks(item);
+                const QImage layerImage = compositeImage(layer, options);
                 if (layerImage.isNull())
                     continue;
 
+                // Effects sit beneath the layer; they follow the layer
+                // opacity but not its fill opacity
+                const QImage effects = renderEffects(layer, options);
+                if (!effects.isNull()) {
+                    painter.save();
+                    painter.setOpacity(painter.opacity() * item->opacity());
+                    painter.drawImage(QRectF(paintedRect(item).marginsAdded(effectMargins(item)).translated(-origin)), effects);
+                    painter.restore();
+                }
+
                 painter.save();
                 painter.setCompositionMode(
                     QtPsdGui::compositionMode(item->record().blendMode()));
                 painter.setOpacity(painter.opacity() * item->opacity() * item->fillOpacity());
-                painter.drawImage(item->rect().topLeft() - origin, layerImage);
+                painter.drawImage(QRectF(paintedRect(item).translated(-origin)), layerImage);
                 painter.restore();
             }
         }
@@ -800,10 +4731,57 @@ int main(int argc, char *argv[])
                                     "address"_L1, "127.0.0.1:8000"_L1);
     parser.addOption(addressOption);
 
+    QCommandLineOption sessionOption(QStringList() << "s"_L1 << "session"_L1,
+                                    "Session file restored on start and updated while running."_L1,
+                                    "file"_L1);
+    parser.addOption(sessionOption);
+
+    QCommandLineOption idleReleaseOption("idle-release"_L1,
+                                         "Seconds without a tool call before caches are released (0 disables)."_L1,
+                                         "seconds"_L1, "300"_L1);
+    parser.addOption(idleReleaseOption);
+
+    QCommandLineOption idleEvictOption("idle-evict"_L1,
+                                       "Seconds without a tool call before the document is unloaded (0 disables)."_L1,
+                                       "seconds"_L1, "0"_L1);
+    parser.addOption(idleEvictOption);
+
+    QCommandLineOption slowMsOption("slow-ms"_L1,
+                                    "Tool calls taking at least this many milliseconds are written to the slow log (0 disables)."_L1,
+                                    "ms"_L1, "1000"_L1);
+    parser.addOption(slowMsOption);
+
+    QCommandLineOption slowLogOption("slow-log"_L1,
+                                     "Slow log file, with the arguments of each slow call (by default slow calls are only counted)."_L1,
+                                     "file"_L1);
+    parser.addOption(slowLogOption);
+
+    QCommandLineOption sharedCacheOption("shared-cache"_L1,
+                                         "MiB of masked layer rasters to share with other mcp-psd2x processes through shared memory (0 disables)."_L1,
+                                         "MiB"_L1, "0"_L1);
+    parser.addOption(sharedCacheOption);
+
+    QCommandLineOption hintJournalOption("hint-journal"_L1,
+                                         "Log unsaved hint edits to a .psd_journal file next to the PSD, for recover_hints."_L1);
+    parser.addOption(hintJournalOption);
+
     parser.process(app);
 
+#if defined(Q_OS_UNIX)
+    StdoutRelay stdoutRelay;
+    if (parser.value(backendOption) == "stdio"_L1)
+        stdoutRelay.start();
+#endif
+
     McpServer server(parser.value(backendOption));
+    server.setSessionFile(parser.value(sessionOption));
+    server.restoreSession();
+    server.setIdleTimeouts(parser.value(idleReleaseOption).toInt(), parser.value(idleEvictOption).toInt());
+    server.setSlowLog(parser.value(slowLogOption), parser.value(slowMsOption).toInt());
+    server.setSharedCacheLimit(parser.value(sharedCacheOption).toLongLong() * 1024 * 1024);
+    server.setHintJournal(parser.isSet(hintJournalOption));
     QObject::connect(&server, &QMcpServer::finished, &app, &QCoreApplication::quit);
+    QObject::connect(&app, &QCoreApplication::aboutToQuit, &server, &McpServer::writeSession);
     server.start(parser.value(addressOption));
 
     return app.exec();